@@ -1,31 +1,243 @@
 #include <SPI.h>
+#include <EEPROM.h>
 #include <Ethernet.h>
+#include <EthernetUdp.h>
 #include <avr/pgmspace.h>
 #include <ICMPPing.h>
 #include <utility/w5100.h>
+#include <utility/socket.h>
+#include <ResponseWriter.h>
+#include <Sessions.h>
+#include <ConfigLog.h>
 
 // Ethernet Configuration (Default)
 byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0x30 };
-IPAddress ip(192, 168, 1, 30);
-IPAddress subnet(255, 255, 255, 0);
-IPAddress gateway(192, 168, 1, 1);
-IPAddress target(192, 168, 1, 31);
 
-EthernetServer server(80);
+struct NetworkSettings {
+  uint8_t ip[4];
+  uint8_t subnet[4];
+  uint8_t gateway[4];
+  uint8_t target[4];   // first ping target
+};
+NetworkSettings network = {
+  { 192, 168, 1, 30 }, { 255, 255, 255, 0 }, { 192, 168, 1, 1 }, { 192, 168, 1, 31 }
+};
+
+// Configuration store, a wear-leveled log of records in EEPROM (see
+// ConfigLog.h). Bump CONFIG_LAYOUT when a section changes.
+#define CONFIG_LAYOUT 3
+
+enum ConfigSectionId : uint8_t { CFG_NETWORK, CFG_PING1, CFG_PING2, CFG_PING3, CFG_LINK, CFG_LOGIN, CFG_SECTIONS };
+
+#define HTTP_PORT 80
+EthernetServer server(HTTP_PORT);
 
 // Relay
 const int relayPin = 7;
 bool relayState = false;
 
-// Login
-const char* username = "admin";
-const char* password = "1234";
+// Login, sessions and the login backoff (see Sessions.h). POST /login
+// opens a session: a random token the browser sends back as the "session"
+// cookie (or a script as "Authorization: Bearer <hex>"), decoded while the
+// headers stream in.
+LoginSettings login;
+SessionTable sessions;
+LoginGuard loginGuard;
+
+// Link watchdog. Up to PING_TARGETS hosts are pinged, each on its own
+// interval. One echo is in flight at a time and its reply is collected on
+// later loop passes, so monitoring never holds up the web server or relay
+// commands. A target goes down after maxFailures lost echoes in a row, or
+// when more than maxLossPct of its last PING_WINDOW echoes were lost; the
+// relay is switched off when a target goes down. Target 1's address is
+// network.target, so its ip field is unused.
+#define PING_TARGETS 3
+#define PING_TIMEOUT_MS 1000
+#define PING_WINDOW 16         // echoes the loss ratio is taken over
+#define PING_MIN_SAMPLES 4     // echoes needed before the loss ratio counts
+
+struct PingSettings {
+  uint8_t ip[4];               // 0.0.0.0 = unused
+  uint16_t intervalS;
+  uint8_t maxLossPct;
+  uint8_t maxFailures;
+};
+PingSettings pingSettings[PING_TARGETS] = {
+  { { 0, 0, 0, 0 }, 60, 50, 3 }, { { 0, 0, 0, 0 }, 60, 50, 3 }, { { 0, 0, 0, 0 }, 60, 50, 3 }
+};
+
+struct PingStats {
+  unsigned long nextAt;        // millis() of the next echo
+  uint16_t history;            // one bit per echo, 1 = lost, newest in bit 0
+  uint8_t count;               // echoes in history
+  uint8_t failures;            // consecutive losses
+  bool down;
+  unsigned long sent;
+  unsigned long lost;
+  uint16_t rttLast;            // ms
+  uint16_t rttMin;
+  uint16_t rttMax;
+  uint16_t rttAvg;             // exponential moving average, 1/8 weight
+};
+PingStats pingStats[PING_TARGETS];
 
-// Ping
 SOCKET pingSocket = 0;
-ICMPPing ping(pingSocket, (uint16_t)random(0, 255));
-unsigned long lastPingTime = 0;
-const unsigned long pingInterval = 300000; // 5 minutes
+ICMPPing ping(pingSocket, 0);
+ICMPEchoReply pingReply;
+bool pingBusy = false;
+unsigned long pingSocketWaits;   // echoes put off with no socket free
+uint8_t pingTarget = 0;        // target of the echo in flight, or the last one
+uint8_t pingId = 0;
+
+// Board link. The two boards replicate their relay state, link mode and
+// relay commands to each other over UDP, at network.target. A frame is
+//   0     LINK_MAGIC
+//   1     epoch, picked at random each boot
+//   2-3   seq: the sender's state sequence number, bumped on every change
+//   4     ack epoch (the receiver's epoch)
+//   5-6   ack: newest receiver seq the sender has applied
+//   7     fields that follow, LINK_ACK if the ack is valid
+//   ...   relay (0/1), mode, command (id, 0/1), for the fields set
+//   n-2   CRC-16 of the bytes before it
+// all little-endian. A field goes out in every frame until the peer acks a
+// seq at or after its last change, so a lost frame costs a resend, never
+// state, and each frame stands on its own; a frame not newer than the
+// last one applied is only acked. Frames are sent on a change, every
+// LINK_RETRY_MS while a change is unacknowledged and otherwise every
+// LINK_HEARTBEAT_MS; a peer silent for LINK_TIMEOUT_MS is down, which
+// bounds failover. A peer that restarts or comes back up opens a new
+// session and is sent the full state. Modes:
+//   off      no link
+//   peer     state is shared; /peer/on and /peer/off switch the peer's relay
+//   mirror   as peer, and the relay follows the peer's relay
+//   standby  as peer, and while the peer is down the relay takes over its
+//            last known state, going back to its own when the peer returns
+// The link keeps one UDP socket open for good (see the socket budget).
+#define LINK_PORT 8888
+#define LINK_MAGIC 0xA7
+#define LINK_HEADER_SIZE 8
+#define LINK_FRAME_MAX (LINK_HEADER_SIZE + 4 + 2)
+#define LINK_HEARTBEAT_MS 500
+#define LINK_RETRY_MS 100
+#define LINK_TIMEOUT_MS 2000
+
+enum LinkMode : uint8_t { LINK_OFF, LINK_PEER, LINK_MIRROR, LINK_STANDBY, LINK_MODES };
+enum LinkField : uint8_t { LF_RELAY, LF_MODE, LF_COMMAND, LF_COUNT };
+#define LINK_ACK 0x80
+
+struct LinkSettings {
+  LinkMode mode;
+};
+LinkSettings linkSettings = { LINK_PEER };
+
+struct BoardLink {
+  uint8_t epoch;
+  uint16_t seq;                // our state sequence number
+  uint16_t changedAt[LF_COUNT];   // seq of each field's last change
+  uint16_t acked;              // newest of our seqs the peer has applied
+  uint16_t sentSeq;            // seq of the last frame sent
+  uint8_t commandId;           // our latest command to the peer, 0 = none
+  bool commandOn;
+  unsigned long sentAt;
+  bool ackDue;
+  // Peer
+  bool up;
+  bool session;                // peerEpoch and peerSeq are valid
+  uint8_t peerEpoch;
+  uint16_t peerSeq;            // newest peer seq applied
+  unsigned long heardAt;
+  bool peerRelayKnown;
+  bool peerRelay;
+  LinkMode peerMode;
+  uint8_t peerCommandId;       // newest peer command carried out
+  // Takeover (standby mode)
+  bool takenOver;
+  bool ownRelay;               // relay state to go back to
+  // Counters
+  unsigned long sent;
+  unsigned long received;
+  unsigned long bad;
+  unsigned long stale;          // frames whose changes were already applied
+  unsigned long failovers;
+};
+BoardLink boardLink;
+EthernetUDP linkUdp;
+
+// The config sections, for the config store
+struct ConfigSections {
+  static const uint8_t COUNT = CFG_SECTIONS;
+  static const uint16_t LAYOUT = CONFIG_LAYOUT;
+  static void* data(uint8_t section);
+  static constexpr uint8_t size(uint8_t section) {
+    return section == CFG_NETWORK ? sizeof(NetworkSettings)
+         : section <= CFG_PING3 ? sizeof(PingSettings)
+         : section == CFG_LINK ? sizeof(LinkSettings)
+         : sizeof(LoginSettings);
+  }
+};
+ConfigLog<ConfigSections> configStore;
+
+// TX write-coalescing buffer (see ResponseWriter.h): pages are copied from
+// PROGMEM in chunks and sent with one socket write per chunk instead of one
+// per byte, a page larger than the socket's free TX space resumed on a
+// later pass
+ResponseWriter txBuffer;
+
+// Socket budget. The W5100 has MAX_SOCK_NUM (4) sockets: the link's UDP
+// socket, open for good; a raw socket per echo for the ping watchdog; and
+// the rest for HTTP, its connections and one listening. The web server
+// opens another listening socket only while one stays closed for the next
+// echo, so busy browsers cannot hold the watchdog off; an echo that still
+// finds no socket is counted as socketWaits in /watchdog.
+#define SOCKETS_LINK 1
+#define SOCKETS_PING 1
+#define SOCKETS_HTTP_MIN 2   // a connection, and listening for the next
+static_assert(SOCKETS_LINK + SOCKETS_PING + SOCKETS_HTTP_MIN <= MAX_SOCK_NUM, "more sockets reserved than the chip has");
+
+// HTTP connections: one state machine per socket, so a slow or half-open
+// browser no longer freezes relay control and the ping watchdog. Only the
+// request line is kept, long enough for a /netconfig query with four
+// addresses; of the headers, only the session token and Content-Length are
+// read. A small form body is appended to the line as its query, so
+// lineParam() reads posted fields too.
+#define HTTP_MAX_CONNECTIONS 3
+#define HTTP_IDLE_TIMEOUT_MS 5000
+#define HTTP_LINE_MAX 112
+#define HTTP_BODY_MAX 64
+#define HTTP_MIN_TX_SPACE 64
+
+enum ConnState : uint8_t { CONN_FREE, CONN_READING, CONN_SENDING, CONN_CLOSING };
+enum PageId : uint8_t { PAGE_LOGIN, PAGE_DENIED, PAGE_REDIRECT, PAGE_CONTROL, PAGE_CONFIG, PAGE_WATCHDOG, PAGE_LINK };
+
+// Headers read; HDR_NONE while the name is still arriving, HDR_SKIP for
+// any other header
+enum HeaderId : uint8_t { HDR_CONTENT_LENGTH, HDR_COOKIE, HDR_AUTHORIZATION, HDR_COUNT, HDR_NONE, HDR_SKIP };
+enum SessionCookie : uint8_t { COOKIE_KEEP, COOKIE_SET, COOKIE_CLEAR };
+
+struct HttpConnection {
+  ConnState state;
+  uint8_t sock;
+  PageId page;
+  bool lineDone;          // request line complete, reading headers
+  bool lineIsBlank;
+  uint8_t lineLen;
+  char line[HTTP_LINE_MAX];
+  HeaderId header;        // header of the current line
+  uint8_t candidates;     // bitmask of HeaderIds whose name still matches
+  uint8_t headerLen;      // characters of the current header line
+  uint16_t contentLength;
+  uint16_t bodyLeft;      // form body bytes still to read
+  uint8_t token[SESSION_TOKEN_BYTES];
+  uint8_t tokenMatch;     // characters of "session=" / "bearer" matched
+  uint8_t tokenDigits;    // hex digits of the token read, 0xFF if malformed
+  int8_t session;         // slot of the request's session, -1 if none
+  SessionCookie cookie;   // Set-Cookie sent with a redirect
+  unsigned long lastActivity;
+  unsigned long sent;     // bytes of the page already handed to the socket
+  uint16_t sentSum;       // their checksum, see ResponseWriter::resume()
+};
+HttpConnection connections[HTTP_MAX_CONNECTIONS];
+uint8_t webNextSock;     // socket to look for new clients on first
 
 // Login Page
 const char loginPage[] PROGMEM = R"rawliteral(
@@ -43,7 +255,7 @@ input[type=submit] {
 input[type=submit]:hover { background-color: #0056b3; }
 </style></head><body>
 <h2>Device Login</h2>
-<form action="/login">
+<form method="post" action="/login">
 Username:<br><input name="user" type="text"><br>
 Password:<br><input name="pass" type="password"><br>
 <input type="submit" value="Login">
@@ -64,7 +276,7 @@ button, input[type=submit] {
 .on:hover { background-color: #218838; }
 .off { background-color: #dc3545; color: white; }
 .off:hover { background-color: #c82333; }
-input[type=text] {
+input[type=text], input[type=password] {
   padding: 8px; margin: 5px; width: 180px; border-radius: 5px; border: 1px solid #ccc;
 }
 .section { margin-top: 30px; }
@@ -76,6 +288,12 @@ input[type=text] {
     <a href="/on"><button class="on">Turn ON</button></a>
     <a href="/off"><button class="off">Turn OFF</button></a>
   </div>
+  <div class="section">
+    <h2>Linked Board</h2>
+    <p>Status: %PEER%</p>
+    <a href="/peer/on"><button class="on">Turn ON</button></a>
+    <a href="/peer/off"><button class="off">Turn OFF</button></a>
+  </div>
   <div class="section">
     <h2>Ethernet Settings</h2>
     <form action="/netconfig">
@@ -86,107 +304,922 @@ input[type=text] {
     <input type="submit" value="Save Settings">
     </form>
   </div>
+  <div class="section">
+    <h2>Login</h2>
+    <form method="post" action="/setlogin">
+    Username:<br><input name="user" type="text"><br>
+    Password:<br><input name="pass" type="password"><br>
+    <input type="submit" value="Change Login">
+    </form>
+    <a href="/logout">Logout</a>
+  </div>
 </div></body></html>
 )rawliteral";
 
 void setup() {
   pinMode(relayPin, OUTPUT);
   digitalWrite(relayPin, LOW);
-  Ethernet.begin(mac, ip, gateway, gateway, subnet);
+  sessions.seed();
+  configRestore();
+  loginBegin(login, sessions);
+  Ethernet.begin(mac, network.ip, network.gateway, network.gateway, network.subnet);
   server.begin();
 
   Serial.begin(9600);
   randomSeed(analogRead(0));
-  Serial.println("Web server started at http://192.168.1.30");
+  pingId = random(0, 255);
+  ICMPPing::setTimeout(PING_TIMEOUT_MS);
+  linkBegin();
+  Serial.print(F("Web server started at http://"));
+  Serial.println(Ethernet.localIP());
 }
 
 void loop() {
-  EthernetClient client = server.available();
-  if (client) {
-    String request = "";
-    boolean currentLineIsBlank = true;
+  // available() keeps a socket listening, but only ever returns the lowest
+  // numbered socket with data, which a busy client can hold for good; new
+  // clients are looked for on every socket, starting after the last one
+  // adopted.
+  if (serverMayListen(HTTP_PORT, HTTP_MAX_CONNECTIONS + 1)) server.available();
+  for (uint8_t i = 0; i < MAX_SOCK_NUM; i++) {
+    uint8_t s = (webNextSock + i) % MAX_SOCK_NUM;
+    if (EthernetClass::_server_port[s] != HTTP_PORT || connectionOn(s)) continue;
+    EthernetClient client(s);
+    uint8_t status = client.status();
+    if ((status != SnSR::ESTABLISHED && status != SnSR::CLOSE_WAIT) || !client.available()) continue;
+    if (!adoptConnection(s)) break;
+    webNextSock = s + 1;
+  }
+
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    if (connections[i].state != CONN_FREE) serviceConnection(connections[i]);
+  }
+
+  taskPing();
+  taskLink();
+  taskConfig();
+}
+
+// Whether the server on port may keep or open a listening socket: one
+// already listens, or it holds fewer than most and a socket is free beyond
+// the one kept for the next echo
+bool serverMayListen(uint16_t port, uint8_t most) {
+  uint8_t held = 0, free = 0;
+  for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+    uint8_t status = W5100.readSnSR(s);
+    if (status == SnSR::CLOSED) free++;
+    else if (EthernetClass::_server_port[s] == port && status == SnSR::LISTEN) return true;
+    else if (EthernetClass::_server_port[s] == port) held++;
+  }
+  return held < most && free > (pingBusy ? 0 : SOCKETS_PING);
+}
+
+// Every change of the relay goes through here, so the peer hears of it
+void setRelay(bool on) {
+  digitalWrite(relayPin, on ? HIGH : LOW);
+  if (on == relayState) return;
+  relayState = on;
+  linkTouch(LF_RELAY);
+}
+
+const uint8_t* pingAddress(uint8_t i) {
+  return i == 0 ? network.target : pingSettings[i].ip;
+}
+
+// Collects the echo in flight, or sends the next one that is due. Targets
+// are taken round robin so a short interval cannot starve the others.
+void taskPing() {
+  unsigned long now = millis();
+  if (pingBusy) {
+    if (!ping.asyncComplete(pingReply)) return;
+    close(pingSocket);
+    pingBusy = false;
+    pingRecord(pingTarget, pingReply.status == SUCCESS, now - pingReply.data.time);
+    return;
+  }
+
+  for (uint8_t k = 1; k <= PING_TARGETS; k++) {
+    uint8_t i = (pingTarget + k) % PING_TARGETS;
+    if (!pingAddress(i)[0] || (long)(now - pingStats[i].nextAt) < 0) continue;
+
+    // The echo needs a raw socket of its own; wait while all are in use
+    SOCKET s = 0;
+    while (s < MAX_SOCK_NUM && W5100.readSnSR(s) != SnSR::CLOSED) s++;
+    if (s == MAX_SOCK_NUM) {
+      pingSocketWaits++;
+      return;
+    }
+
+    pingTarget = i;
+    pingStats[i].nextAt = now + pingSettings[i].intervalS * 1000UL;
+    pingSocket = s;
+    ping = ICMPPing(s, ++pingId);
+    if (ping.asyncStart(IPAddress(pingAddress(i)), 0, pingReply)) {
+      pingBusy = true;
+    } else {
+      close(s);
+      pingRecord(i, false, 0);
+    }
+    return;
+  }
+}
+
+// Adds one echo to a target's statistics and re-evaluates its state
+void pingRecord(uint8_t i, bool ok, unsigned long rtt) {
+  PingStats& st = pingStats[i];
+  const PingSettings& cfg = pingSettings[i];
+  st.sent++;
+  st.history <<= 1;
+  if (st.count < PING_WINDOW) st.count++;
+
+  if (ok) {
+    st.failures = 0;
+    st.rttLast = min(rtt, 0xFFFFUL);
+    if (st.sent - st.lost == 1) {
+      st.rttMin = st.rttMax = st.rttAvg = st.rttLast;
+    } else {
+      st.rttMin = min(st.rttMin, st.rttLast);
+      st.rttMax = max(st.rttMax, st.rttLast);
+      st.rttAvg = st.rttAvg - st.rttAvg / 8 + st.rttLast / 8;
+    }
+  } else {
+    st.history |= 1;
+    st.lost++;
+    if (st.failures < 0xFF) st.failures++;
+  }
+
+  uint8_t lost = pingWindowLost(st);
+  bool down = st.failures >= cfg.maxFailures ||
+              (st.count >= PING_MIN_SAMPLES && lost * 100U > (uint16_t)cfg.maxLossPct * st.count);
+  if (down && !st.down) {
+    Serial.print(F("Ping target "));
+    Serial.print(i + 1);
+    Serial.println(F(" down. Turning off relay!"));
+    setRelay(false);
+  } else if (!down && st.down) {
+    Serial.print(F("Ping target "));
+    Serial.print(i + 1);
+    Serial.println(F(" up"));
+  }
+  st.down = down;
+}
+
+uint8_t pingWindowLost(const PingStats& st) {
+  uint8_t n = 0;
+  for (uint16_t h = st.history; h; h &= h - 1) n++;
+  return n;
+}
+
+void linkBegin() {
+  BoardLink& l = boardLink;
+  l.epoch = random(0, 256);
+  l.seq = 1;
+  for (uint8_t f = 0; f < LF_COUNT; f++) l.changedAt[f] = l.seq;
+  l.changedAt[LF_COMMAND] = 0;   // no command yet
+  linkUdp.begin(LINK_PORT);
+}
+
+// Takes in what the peer sent, then sends a frame if one is due
+void taskLink() {
+  BoardLink& l = boardLink;
+  for (uint8_t i = 0; i < 4; i++) {
+    int size = linkUdp.parsePacket();
+    if (!size) break;
+    linkReceive(size);
+  }
+  if (linkSettings.mode == LINK_OFF) return;
+
+  // Changes are retried quickly only while the peer answers
+  unsigned long now = millis();
+  if (l.up && now - l.heardAt >= LINK_TIMEOUT_MS) linkPeerDown();
+  unsigned long since = now - l.sentAt;
+  if (l.ackDue || l.seq != l.sentSeq || since >= LINK_HEARTBEAT_MS ||
+      (l.up && linkPending() && since >= LINK_RETRY_MS)) linkSend();
+}
+
+void linkTouch(LinkField field) {
+  boardLink.changedAt[field] = ++boardLink.seq;
+}
+
+bool linkFieldPending(LinkField field) {
+  return seqAfter(boardLink.changedAt[field], boardLink.acked);
+}
+
+bool linkPending() {
+  for (uint8_t f = 0; f < LF_COUNT; f++) {
+    if (linkFieldPending((LinkField)f)) return true;
+  }
+  return false;
+}
+
+// Switches the peer's relay
+void linkCommand(bool on) {
+  if (linkSettings.mode == LINK_OFF) return;
+  if (++boardLink.commandId == 0) boardLink.commandId = 1;
+  boardLink.commandOn = on;
+  linkTouch(LF_COMMAND);
+}
+
+void linkSend() {
+  BoardLink& l = boardLink;
+  uint8_t frame[LINK_FRAME_MAX];
+  uint8_t fields = l.session ? LINK_ACK : 0;
+  frame[0] = LINK_MAGIC;
+  frame[1] = l.epoch;
+  frame[2] = l.seq & 0xFF;
+  frame[3] = l.seq >> 8;
+  frame[4] = l.peerEpoch;
+  frame[5] = l.peerSeq & 0xFF;
+  frame[6] = l.peerSeq >> 8;
+  uint8_t n = LINK_HEADER_SIZE;
+  if (linkFieldPending(LF_RELAY)) {
+    fields |= 1 << LF_RELAY;
+    frame[n++] = relayState;
+  }
+  if (linkFieldPending(LF_MODE)) {
+    fields |= 1 << LF_MODE;
+    frame[n++] = linkSettings.mode;
+  }
+  if (linkFieldPending(LF_COMMAND)) {
+    fields |= 1 << LF_COMMAND;
+    frame[n++] = l.commandId;
+    frame[n++] = l.commandOn;
+  }
+  frame[7] = fields;
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < n; i++) crc = crc16Update(crc, frame[i]);
+  frame[n++] = crc & 0xFF;
+  frame[n++] = crc >> 8;
+
+  linkUdp.beginPacket(IPAddress(network.target), LINK_PORT);
+  linkUdp.write(frame, n);
+  linkUdp.endPacket();
+  l.sentAt = millis();
+  l.sentSeq = l.seq;
+  l.ackDue = false;
+  l.sent++;
+}
+
+// Length of a frame carrying these fields, CRC included
+uint8_t linkFrameSize(uint8_t fields) {
+  return LINK_HEADER_SIZE + ((fields >> LF_RELAY) & 1) + ((fields >> LF_MODE) & 1) + 2 * ((fields >> LF_COMMAND) & 1) + 2;
+}
+
+void linkReceive(int size) {
+  BoardLink& l = boardLink;
+  uint8_t frame[LINK_FRAME_MAX];
+  IPAddress from = linkUdp.remoteIP();
+  int n = linkUdp.read(frame, sizeof(frame));
+  while (linkUdp.available()) linkUdp.read();
+  if (linkSettings.mode == LINK_OFF || !(from == network.target)) return;
+
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < n - 2; i++) crc = crc16Update(crc, frame[i]);
+  if (size != n || n < LINK_HEADER_SIZE + 2 || frame[0] != LINK_MAGIC || (frame[7] & ~(LINK_ACK | ((1 << LF_COUNT) - 1))) ||
+      n != linkFrameSize(frame[7]) || frame[n - 2] != (crc & 0xFF) || frame[n - 1] != (crc >> 8)) {
+    l.bad++;
+    return;
+  }
+
+  uint8_t epoch = frame[1];
+  uint16_t seq = frame[2] | (frame[3] << 8);
+  uint16_t ack = frame[5] | (frame[6] << 8);
+  uint8_t fields = frame[7];
+  l.received++;
+  l.heardAt = millis();
+
+  // A restarted peer, or one back from being down, starts a new session:
+  // whatever it sends is taken, and it gets our full state
+  bool wasUp = l.up;
+  bool restarted = !l.session || epoch != l.peerEpoch;
+  if (restarted || !wasUp) {
+    if (restarted) l.peerCommandId = 0;
+    l.session = true;
+    l.peerEpoch = epoch;
+    l.peerSeq = seq - 1;
+    linkResync();
+  }
+  if ((fields & LINK_ACK) && frame[4] == l.epoch && !seqAfter(ack, l.seq) && seqAfter(ack, l.acked)) l.acked = ack;
+  if (fields & ~LINK_ACK) l.ackDue = true;
+  if (!wasUp) linkPeerUp();
+
+  if (!seqAfter(seq, l.peerSeq)) {
+    if (fields & ~LINK_ACK) l.stale++;   // a resend or reordered frame
+    return;
+  }
+  l.peerSeq = seq;
+  uint8_t at = LINK_HEADER_SIZE;
+  if (fields & (1 << LF_RELAY)) {
+    l.peerRelay = frame[at++];
+    l.peerRelayKnown = true;
+    if (linkSettings.mode == LINK_MIRROR) setRelay(l.peerRelay);
+  }
+  if (fields & (1 << LF_MODE)) l.peerMode = (LinkMode)min(frame[at++], (uint8_t)(LINK_MODES - 1));
+  if (fields & (1 << LF_COMMAND)) {
+    uint8_t id = frame[at++];
+    bool on = frame[at++];
+    if (id && id != l.peerCommandId) {
+      l.peerCommandId = id;
+      setRelay(on);
+    }
+  }
+}
+
+// Marks our state for resending in full, bar a command the peer already
+// carried out
+void linkResync() {
+  BoardLink& l = boardLink;
+  bool commandPending = l.commandId && linkFieldPending(LF_COMMAND);
+  linkTouch(LF_RELAY);
+  l.changedAt[LF_MODE] = l.seq;
+  if (commandPending) l.changedAt[LF_COMMAND] = l.seq;
+}
+
+void linkPeerUp() {
+  BoardLink& l = boardLink;
+  l.up = true;
+  Serial.println(F("Linked board up"));
+  if (l.takenOver) {
+    l.takenOver = false;
+    setRelay(l.ownRelay);
+  }
+}
 
-    while (client.connected()) {
-      if (client.available()) {
+void linkPeerDown() {
+  BoardLink& l = boardLink;
+  l.up = false;
+  l.failovers++;
+  Serial.println(F("Linked board down"));
+  if (linkSettings.mode == LINK_STANDBY && l.peerRelayKnown && !l.takenOver) {
+    l.takenOver = true;
+    l.ownRelay = relayState;
+    setRelay(l.peerRelay);
+  }
+}
+
+void* ConfigSections::data(uint8_t section) {
+  switch (section) {
+    case CFG_NETWORK: return &network;
+    case CFG_PING1: case CFG_PING2: case CFG_PING3: return &pingSettings[section - CFG_PING1];
+    case CFG_LINK: return &linkSettings;
+    default: return &login;
+  }
+}
+
+// Loads the saved settings over the defaults
+void configRestore() {
+  configStore.restore();
+}
+
+void configSave(ConfigSectionId section) {
+  configStore.save(section);
+}
+
+void taskConfig() {
+  configStore.task();
+}
+
+// Reads user= and pass= from the request into buffers of LOGIN_FIELD_MAX,
+// resolving %XX escapes and '+'; false if either is missing or too long
+bool loginParams(const HttpConnection& conn, char* user, char* pass) {
+  return lineParamDecoded(conn, PSTR("user"), user, LOGIN_FIELD_MAX) && *user &&
+         lineParamDecoded(conn, PSTR("pass"), pass, LOGIN_FIELD_MAX) && *pass;
+}
+
+// The connection tracking a socket, if any
+HttpConnection* connectionOn(uint8_t sock) {
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+    if (connections[i].state != CONN_FREE && connections[i].sock == sock) return &connections[i];
+  }
+  return nullptr;
+}
+
+// Claims a free slot for a new client's socket. With all slots busy the
+// socket waits on the chip.
+HttpConnection* adoptConnection(uint8_t sock) {
+  HttpConnection* free = nullptr;
+  for (uint8_t i = 0; i < HTTP_MAX_CONNECTIONS && !free; i++) {
+    if (connections[i].state == CONN_FREE) free = &connections[i];
+  }
+  if (!free) return nullptr;
+
+  memset(free, 0, sizeof(*free));
+  free->state = CONN_READING;
+  free->sock = sock;
+  free->lineIsBlank = true;
+  free->session = -1;
+  headerStart(*free);
+  free->lastActivity = millis();
+  return free;
+}
+
+void headerStart(HttpConnection& conn) {
+  conn.header = HDR_NONE;
+  conn.candidates = (1 << HDR_COUNT) - 1;
+  conn.headerLen = 0;
+  conn.tokenMatch = 0;
+}
+
+const char headerContentLength[] PROGMEM = "content-length";
+const char headerCookie[] PROGMEM = "cookie";
+const char headerAuthorization[] PROGMEM = "authorization";
+PGM_P const headerNames[HDR_COUNT] PROGMEM = { headerContentLength, headerCookie, headerAuthorization };
+
+#define TOKEN_MISMATCH 0xFF
+
+int8_t hexDigit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Reads a session token following prefix, matched case-insensitively
+void tokenChar(HttpConnection& conn, char c, PGM_P prefix) {
+  uint8_t n = strlen_P(prefix);
+  if (conn.tokenMatch == TOKEN_MISMATCH) return;
+  if (conn.tokenMatch < n) {
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    conn.tokenMatch = c == (char)pgm_read_byte(prefix + conn.tokenMatch) ? conn.tokenMatch + 1 : TOKEN_MISMATCH;
+    if (conn.tokenMatch == n) conn.tokenDigits = 0;
+    return;
+  }
+  int8_t d = hexDigit(c);
+  if (d < 0 || conn.tokenDigits >= 2 * SESSION_TOKEN_BYTES) {
+    conn.tokenDigits = 0xFF;
+    return;
+  }
+  uint8_t& b = conn.token[conn.tokenDigits++ / 2];
+  b = (b << 4) | d;
+}
+
+// One character of a header line: the name is matched against headerNames
+// as it arrives, then the value of a known header is read with its spaces
+// dropped
+void headerChar(HttpConnection& conn, char c) {
+  if (c == '\r') return;
+  if (c == '\n') {
+    headerStart(conn);
+    return;
+  }
+  if (conn.header == HDR_NONE) {
+    if (c == ':') {
+      conn.header = HDR_SKIP;
+      for (uint8_t i = 0; i < HDR_COUNT; i++) {
+        if ((conn.candidates & (1 << i)) && strlen_P((PGM_P)pgm_read_ptr(&headerNames[i])) == conn.headerLen) conn.header = (HeaderId)i;
+      }
+      return;
+    }
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    for (uint8_t i = 0; i < HDR_COUNT; i++) {
+      PGM_P name = (PGM_P)pgm_read_ptr(&headerNames[i]);
+      if (conn.headerLen >= strlen_P(name) || pgm_read_byte(name + conn.headerLen) != c) conn.candidates &= ~(1 << i);
+    }
+    if (!conn.candidates) conn.header = HDR_SKIP;
+    if (conn.headerLen < 255) conn.headerLen++;
+    return;
+  }
+  if (c == ' ' || c == '\t') return;
+  switch (conn.header) {
+    case HDR_CONTENT_LENGTH:
+      if (c >= '0' && c <= '9' && conn.contentLength < 6553) conn.contentLength = conn.contentLength * 10 + (c - '0');
+      else conn.contentLength = 0xFFFF;
+      break;
+    case HDR_COOKIE:
+      // "a=1;session=<hex>;b=2": each cookie starts the match over
+      if (c == ';') conn.tokenMatch = 0;
+      else tokenChar(conn, c, PSTR("session="));
+      break;
+    case HDR_AUTHORIZATION:
+      tokenChar(conn, c, PSTR("bearer"));
+      break;
+    default:
+      break;
+  }
+}
+
+void serviceConnection(HttpConnection& conn) {
+  EthernetClient client(conn.sock);
+  unsigned long now = millis();
+
+  switch (conn.state) {
+    case CONN_READING:
+      if (!client.available()) {
+        if (!client.connected()) {
+          client.stop();
+          conn.state = CONN_FREE;
+          return;
+        }
+        break;
+      }
+      conn.lastActivity = now;
+      while (client.available()) {
         char c = client.read();
-        request += c;
-
-        if (c == '\n' && currentLineIsBlank) {
-          if (request.indexOf("GET /login?user=admin&pass=1234") >= 0) {
-            sendControlPage(client);
-          } else if (request.indexOf("GET /on") >= 0) {
-            relayState = true;
-            digitalWrite(relayPin, HIGH);
-            sendControlPage(client);
-          } else if (request.indexOf("GET /off") >= 0) {
-            relayState = false;
-            digitalWrite(relayPin, LOW);
-            sendControlPage(client);
-          } else if (request.indexOf("GET /netconfig?") >= 0) {
-            sendConfigSuccess(client);
-          } else {
-            sendLoginPage(client);
+        if (conn.bodyLeft) {
+          if (conn.lineLen < HTTP_LINE_MAX - 1) conn.line[conn.lineLen++] = c;
+          if (--conn.bodyLeft == 0) {
+            startResponse(conn, client);
+            break;
           }
+          continue;
+        }
+        if (!conn.lineDone) {
+          if (c == '\r' || c == '\n') conn.lineDone = true;
+          else if (conn.lineLen < HTTP_LINE_MAX - 1) conn.line[conn.lineLen++] = c;
+        } else {
+          headerChar(conn, c);
+        }
+        if (c == '\n' && conn.lineIsBlank) {
+          if (conn.contentLength && conn.contentLength <= HTTP_BODY_MAX && conn.lineLen < HTTP_LINE_MAX - 1) {
+            // The body joins the request line's query, or starts one
+            char joint = memchr(conn.line, '?', conn.lineLen) ? '&' : '?';
+            conn.line[conn.lineLen++] = joint;
+            conn.bodyLeft = conn.contentLength;
+            continue;
+          }
+          startResponse(conn, client);
           break;
         }
-        if (c == '\n') currentLineIsBlank = true;
-        else if (c != '\r') currentLineIsBlank = false;
+        if (c == '\n') conn.lineIsBlank = true;
+        else if (c != '\r') conn.lineIsBlank = false;
       }
+      break;
+
+    case CONN_SENDING:
+      if (W5100.getTXFreeSize(conn.sock) >= HTTP_MIN_TX_SPACE) {
+        conn.lastActivity = now;
+        sendPage(conn, client);
+      }
+      break;
+
+    case CONN_CLOSING: {
+      // stop() waits for the close handshake, so only call it once done.
+      // server.available() reopens a closed socket to listen, so the socket
+      // may already be serving a new client by now; it is no longer ours.
+      uint8_t status = client.status();
+      if (status == SnSR::CLOSED) client.stop();
+      if (status != SnSR::FIN_WAIT && status != SnSR::CLOSING && status != SnSR::TIME_WAIT &&
+          status != SnSR::LAST_ACK) {
+        conn.state = CONN_FREE;
+        return;
+      }
+      break;
     }
-    delay(1);
+
+    case CONN_FREE:
+      return;
+  }
+
+  if (conn.state != CONN_FREE && now - conn.lastActivity > HTTP_IDLE_TIMEOUT_MS) {
     client.stop();
+    conn.state = CONN_FREE;
   }
+}
 
-  // Ping every 5 minutes
-  if (millis() - lastPingTime > pingInterval) {
-    lastPingTime = millis();
-    ICMPEchoReply echoReply = ping(target, 4);
-    if (echoReply.status != SUCCESS) {
-      Serial.println("Ping failed. Turning off relay!");
-      relayState = false;
-      digitalWrite(relayPin, LOW);
-    } else {
-      Serial.println("Ping OK!");
+bool lineStartsWith(const HttpConnection& conn, PGM_P prefix) {
+  return strncmp_P(conn.line, prefix, strlen_P(prefix)) == 0;
+}
+
+// Copies a query parameter's value from the request line, truncated to
+// size - 1 characters; false if the parameter is absent
+bool lineParam(const HttpConnection& conn, PGM_P key, char* out, uint8_t size) {
+  uint8_t keyLen = strlen_P(key);
+  for (const char* p = strchr(conn.line, '?'); p; p = strchr(p + 1, '&')) {
+    if (strncmp_P(p + 1, key, keyLen) != 0 || p[1 + keyLen] != '=') continue;
+    const char* value = p + 2 + keyLen;
+    uint8_t n = 0;
+    while (value[n] && value[n] != '&' && value[n] != ' ' && n < size - 1) { out[n] = value[n]; n++; }
+    out[n] = '\0';
+    return true;
+  }
+  return false;
+}
+
+// lineParam() resolving %XX escapes and '+', as browsers encode form fields;
+// false if the parameter is absent or its value does not fit
+bool lineParamDecoded(const HttpConnection& conn, PGM_P key, char* out, uint8_t size) {
+  uint8_t keyLen = strlen_P(key);
+  for (const char* p = strchr(conn.line, '?'); p; p = strchr(p + 1, '&')) {
+    if (strncmp_P(p + 1, key, keyLen) != 0 || p[1 + keyLen] != '=') continue;
+    uint8_t n = 0;
+    for (const char* v = p + 2 + keyLen; *v && *v != '&' && *v != ' '; v++) {
+      char c = *v;
+      if (c == '+') {
+        c = ' ';
+      } else if (c == '%' && hexDigit(v[1]) >= 0 && hexDigit(v[2]) >= 0) {
+        c = (hexDigit(v[1]) << 4) | hexDigit(v[2]);
+        v += 2;
+      }
+      if (n == size - 1) return false;
+      out[n++] = c;
     }
+    out[n] = '\0';
+    return true;
   }
+  return false;
 }
 
-void sendLoginPage(EthernetClient& client) {
-  client.println(F("HTTP/1.1 200 OK"));
-  client.println(F("Content-Type: text/html"));
-  client.println();
-  for (uint16_t i = 0; i < sizeof(loginPage) - 1; i++) {
-    client.write(pgm_read_byte_near(loginPage + i));
+// Reads an "a.b.c.d" query parameter from the request line into 4 bytes,
+// leaving the target untouched if it is absent or malformed
+void lineParamIP(const HttpConnection& conn, PGM_P key, uint8_t* out) {
+  char buf[16];
+  IPAddress addr;
+  if (!lineParam(conn, key, buf, sizeof(buf)) || !addr.fromString(buf)) return;
+  for (uint8_t i = 0; i < 4; i++) out[i] = addr[i];
+}
+
+// Numeric query parameter clamped to [lo, hi]; def if absent
+long lineParamNumber(const HttpConnection& conn, PGM_P key, long def, long lo, long hi) {
+  char buf[8];
+  if (!lineParam(conn, key, buf, sizeof(buf))) return def;
+  return constrain(atol(buf), lo, hi);
+}
+
+// /watchdog?n=<1-3>&ip=a.b.c.d&interval=<s>&loss=<%>&fails=<count>; every
+// parameter but n is optional. A changed target starts over with fresh
+// statistics and is pinged right away.
+void watchdogConfig(const HttpConnection& conn) {
+  uint8_t i = lineParamNumber(conn, PSTR("n"), 0, 0, PING_TARGETS) - 1;
+  if (i >= PING_TARGETS) return;
+  PingSettings& cfg = pingSettings[i];
+  lineParamIP(conn, PSTR("ip"), i == 0 ? network.target : cfg.ip);
+  cfg.intervalS = lineParamNumber(conn, PSTR("interval"), cfg.intervalS, 1, 3600);
+  cfg.maxLossPct = lineParamNumber(conn, PSTR("loss"), cfg.maxLossPct, 0, 100);
+  cfg.maxFailures = lineParamNumber(conn, PSTR("fails"), cfg.maxFailures, 1, 255);
+  if (i == 0) configSave(CFG_NETWORK);
+  configSave((ConfigSectionId)(CFG_PING1 + i));
+
+  if (pingBusy && pingTarget == i) {
+    close(pingSocket);
+    pingBusy = false;
+  }
+  memset(&pingStats[i], 0, sizeof(pingStats[i]));
+  pingStats[i].nextAt = millis();
+}
+
+const char linkModeOff[] PROGMEM = "off";
+const char linkModePeer[] PROGMEM = "peer";
+const char linkModeMirror[] PROGMEM = "mirror";
+const char linkModeStandby[] PROGMEM = "standby";
+PGM_P const linkModeNames[LINK_MODES] PROGMEM = { linkModeOff, linkModePeer, linkModeMirror, linkModeStandby };
+
+// /link?mode=<off|peer|mirror|standby>; without a mode only the status is
+// returned
+void linkConfig(const HttpConnection& conn) {
+  char buf[8];
+  if (!lineParam(conn, PSTR("mode"), buf, sizeof(buf))) return;
+  for (uint8_t m = 0; m < LINK_MODES; m++) {
+    if (strcmp_P(buf, (PGM_P)pgm_read_ptr(&linkModeNames[m])) != 0) continue;
+    if (m == linkSettings.mode) return;
+    if (boardLink.takenOver) {
+      boardLink.takenOver = false;
+      setRelay(boardLink.ownRelay);
+    }
+    linkSettings.mode = (LinkMode)m;
+    linkTouch(LF_MODE);
+    configSave(CFG_LINK);
+    return;
   }
 }
 
-void sendControlPage(EthernetClient& client) {
-  client.println(F("HTTP/1.1 200 OK"));
-  client.println(F("Content-Type: text/html"));
-  client.println();
+// POST /login: a matching user= and pass= opens a session, sent as a cookie
+// with a redirect to the control page
+void loginRequest(HttpConnection& conn) {
+  char user[LOGIN_FIELD_MAX], pass[LOGIN_FIELD_MAX];
+  if (!loginGuard.allowed() || !loginParams(conn, user, pass) || !loginGuard.attempt(login, user, pass)) {
+    conn.page = PAGE_DENIED;
+    return;
+  }
+  if (conn.session >= 0) sessions.slots[conn.session].live = false;
+  conn.session = sessions.open();
+  conn.cookie = COOKIE_SET;
+  conn.page = PAGE_REDIRECT;
+}
+
+// POST /setlogin with user= and pass=, each 1-31 characters; the other
+// sessions end
+void loginChange(HttpConnection& conn) {
+  char user[LOGIN_FIELD_MAX], pass[LOGIN_FIELD_MAX];
+  if (loginParams(conn, user, pass)) {
+    loginSet(login, sessions, user, pass);
+    configSave(CFG_LOGIN);
+    sessions.closeOthers(conn.session);
+  }
+  conn.page = PAGE_REDIRECT;
+}
+
+void startResponse(HttpConnection& conn, EthernetClient& client) {
+  conn.line[conn.lineLen] = '\0';
+  if (conn.tokenDigits == 2 * SESSION_TOKEN_BYTES) conn.session = sessions.find(conn.token);
+  if (lineStartsWith(conn, PSTR("POST /login"))) {
+    loginRequest(conn);
+  } else if (conn.session < 0) {
+    // Everything but the login page needs a session
+    conn.page = lineStartsWith(conn, PSTR("GET / ")) ? PAGE_LOGIN : PAGE_DENIED;
+  } else if (lineStartsWith(conn, PSTR("GET /logout"))) {
+    sessions.slots[conn.session].live = false;
+    conn.cookie = COOKIE_CLEAR;
+    conn.page = PAGE_REDIRECT;
+  } else if (lineStartsWith(conn, PSTR("POST /setlogin"))) {
+    loginChange(conn);
+  } else if (lineStartsWith(conn, PSTR("GET /on"))) {
+    setRelay(true);
+    conn.page = PAGE_CONTROL;
+  } else if (lineStartsWith(conn, PSTR("GET /off"))) {
+    setRelay(false);
+    conn.page = PAGE_CONTROL;
+  } else if (lineStartsWith(conn, PSTR("GET /peer/on"))) {
+    linkCommand(true);
+    conn.page = PAGE_CONTROL;
+  } else if (lineStartsWith(conn, PSTR("GET /peer/off"))) {
+    linkCommand(false);
+    conn.page = PAGE_CONTROL;
+  } else if (lineStartsWith(conn, PSTR("GET /netconfig?"))) {
+    // Address changes take effect at the next boot, the ping target at once
+    lineParamIP(conn, PSTR("ip"), network.ip);
+    lineParamIP(conn, PSTR("subnet"), network.subnet);
+    lineParamIP(conn, PSTR("gateway"), network.gateway);
+    lineParamIP(conn, PSTR("target"), network.target);
+    configSave(CFG_NETWORK);
+    conn.page = PAGE_CONFIG;
+  } else if (lineStartsWith(conn, PSTR("GET /watchdog"))) {
+    watchdogConfig(conn);
+    conn.page = PAGE_WATCHDOG;
+  } else if (lineStartsWith(conn, PSTR("GET /link"))) {
+    linkConfig(conn);
+    conn.page = PAGE_LINK;
+  } else {
+    conn.page = PAGE_CONTROL;
+  }
+  conn.sent = 0;
+  conn.sentSum = 0;
+  conn.state = CONN_SENDING;
+  sendPage(conn, client);
+}
+
+// Renders the connection's page into whatever TX space the socket has,
+// picking up after the bytes already sent.
+void sendPage(HttpConnection& conn, EthernetClient& client) {
+  ResponseWriter& out = txBuffer.resume(client, conn.sent, W5100.getTXFreeSize(conn.sock), conn.sentSum);
+  switch (conn.page) {
+    case PAGE_LOGIN: sendLoginPage(out, false); break;
+    case PAGE_DENIED: sendLoginPage(out, true); break;
+    case PAGE_REDIRECT: sendRedirect(out, conn); break;
+    case PAGE_CONTROL: sendControlPage(out); break;
+    case PAGE_CONFIG: sendConfigSuccess(out); break;
+    case PAGE_WATCHDOG: sendWatchdogStatus(out); break;
+    case PAGE_LINK: sendLinkStatus(out); break;
+  }
+  out.flush();
+  conn.sent = out.sent();
+  conn.sentSum = out.sentSum();
+  if (out.changed) {
+    // A page ends where the connection does, so a clean close would pass
+    // off the part sent as all of it; abort without FIN instead
+    close(conn.sock);
+    client.stop();
+    conn.state = CONN_FREE;
+  } else if (!out.more) {
+    // FIN without waiting; serviceConnection() frees the slot once closed
+    disconnect(conn.sock);
+    conn.state = CONN_CLOSING;
+    conn.lastActivity = millis();
+  }
+}
+
+void sendLoginPage(ResponseWriter& out, bool denied) {
+  out.println(denied ? F("HTTP/1.1 401 Unauthorized") : F("HTTP/1.1 200 OK"));
+  out.println(F("Content-Type: text/html"));
+  out.println();
+  out.writeP(loginPage, sizeof(loginPage) - 1);
+}
+
+// 303 to the control page, so a reload does not repeat a POST; carries the
+// session cookie after a login, or clears it after a logout
+void sendRedirect(ResponseWriter& out, const HttpConnection& conn) {
+  out.println(F("HTTP/1.1 303 See Other"));
+  out.println(F("Location: /"));
+  if (conn.cookie == COOKIE_SET) {
+    out.print(F("Set-Cookie: session="));
+    printToken(out, sessions.slots[conn.session].token);
+    out.println(F("; Path=/; HttpOnly; SameSite=Strict"));
+  } else if (conn.cookie == COOKIE_CLEAR) {
+    out.println(F("Set-Cookie: session=; Path=/; Max-Age=0"));
+  }
+  out.println();
+}
+
+void sendControlPage(ResponseWriter& out) {
+  out.println(F("HTTP/1.1 200 OK"));
+  out.println(F("Content-Type: text/html"));
+  out.println();
   const char* ptr = controlPage;
-  bool stateInserted = false;
+  uint16_t runStart = 0;
   for (uint16_t i = 0; i < sizeof(controlPage) - 1; i++) {
-    char c = pgm_read_byte_near(ptr + i);
-    if (!stateInserted && c == '%' &&
-        pgm_read_byte_near(ptr + i + 1) == 'S' &&
-        pgm_read_byte_near(ptr + i + 2) == 'T' &&
-        pgm_read_byte_near(ptr + i + 3) == 'A' &&
-        pgm_read_byte_near(ptr + i + 4) == 'T' &&
-        pgm_read_byte_near(ptr + i + 5) == 'E' &&
-        pgm_read_byte_near(ptr + i + 6) == '%') {
-      client.print(relayState ? "ON" : "OFF");
+    if (pgm_read_byte_near(ptr + i) != '%') continue;
+    if (strncmp_P("%STATE%", ptr + i, 7) == 0) {
+      out.writeP(ptr + runStart, i - runStart);
+      out.print(relayState ? F("ON") : F("OFF"));
       i += 6;
-      stateInserted = true;
-    } else {
-      client.write(c);
+      runStart = i + 1;
+    } else if (strncmp_P("%PEER%", ptr + i, 6) == 0) {
+      out.writeP(ptr + runStart, i - runStart);
+      if (linkSettings.mode == LINK_OFF) out.print(F("Link off"));
+      else if (!boardLink.up) out.print(F("Unreachable"));
+      else out.print(!boardLink.peerRelayKnown ? F("--") : boardLink.peerRelay ? F("ON") : F("OFF"));
+      i += 5;
+      runStart = i + 1;
     }
   }
+  out.writeP(ptr + runStart, sizeof(controlPage) - 1 - runStart);
+}
+
+void sendConfigSuccess(ResponseWriter& out) {
+  out.println(F("HTTP/1.1 200 OK"));
+  out.println(F("Content-Type: text/html"));
+  out.println();
+  out.println(F("<html><body><h2>Settings Saved</h2><p>Restart the device to use the new address.</p><a href='/'>Back</a></body></html>"));
+}
+
+// Per-target settings, state and statistics as JSON; rtt is
+// [last, min, avg, max] in ms
+void sendWatchdogStatus(ResponseWriter& out) {
+  out.println(F("HTTP/1.1 200 OK"));
+  out.println(F("Content-Type: application/json"));
+  out.println();
+  out.print(F("{\"targets\":["));
+  for (uint8_t i = 0; i < PING_TARGETS; i++) {
+    const PingSettings& cfg = pingSettings[i];
+    const PingStats& st = pingStats[i];
+    if (i) out.print(',');
+    out.print(F("{\"ip\":\""));
+    out.print(IPAddress(pingAddress(i)));
+    out.print(F("\",\"interval\":"));
+    out.print(cfg.intervalS);
+    out.print(F(",\"maxLossPct\":"));
+    out.print(cfg.maxLossPct);
+    out.print(F(",\"maxFailures\":"));
+    out.print(cfg.maxFailures);
+    out.print(F(",\"up\":"));
+    out.print(st.down ? 0 : 1);
+    out.print(F(",\"sent\":"));
+    out.print(st.sent);
+    out.print(F(",\"lost\":"));
+    out.print(st.lost);
+    out.print(F(",\"windowLost\":"));
+    out.print(pingWindowLost(st));
+    out.print(F(",\"window\":"));
+    out.print(st.count);
+    out.print(F(",\"failures\":"));
+    out.print(st.failures);
+    out.print(F(",\"rtt\":["));
+    out.print(st.rttLast);
+    out.print(',');
+    out.print(st.rttMin);
+    out.print(',');
+    out.print(st.rttAvg);
+    out.print(',');
+    out.print(st.rttMax);
+    out.print(F("]}"));
+  }
+  out.print(F("],\"socketWaits\":"));
+  out.print(pingSocketWaits);
+  out.print('}');
 }
 
-void sendConfigSuccess(EthernetClient& client) {
-  client.println(F("HTTP/1.1 200 OK"));
-  client.println(F("Content-Type: text/html"));
-  client.println();
-  client.println(F("<html><body><h2>Settings Saved (not stored yet)</h2><a href='/login?user=admin&pass=1234'>Back</a></body></html>"));
+// Link mode, peer state and protocol counters as JSON
+void sendLinkStatus(ResponseWriter& out) {
+  const BoardLink& l = boardLink;
+  out.println(F("HTTP/1.1 200 OK"));
+  out.println(F("Content-Type: application/json"));
+  out.println();
+  out.print(F("{\"mode\":\""));
+  out.print((const __FlashStringHelper*)pgm_read_ptr(&linkModeNames[linkSettings.mode]));
+  out.print(F("\",\"peer\":\""));
+  out.print(IPAddress(network.target));
+  out.print(F("\",\"up\":"));
+  out.print(l.up ? 1 : 0);
+  out.print(F(",\"peerRelay\":"));
+  if (l.peerRelayKnown) out.print(l.peerRelay ? 1 : 0);
+  else out.print(F("null"));
+  out.print(F(",\"peerMode\":\""));
+  out.print((const __FlashStringHelper*)pgm_read_ptr(&linkModeNames[l.peerMode]));
+  out.print(F("\",\"takenOver\":"));
+  out.print(l.takenOver ? 1 : 0);
+  out.print(F(",\"seq\":"));
+  out.print(l.seq);
+  out.print(F(",\"acked\":"));
+  out.print(l.acked);
+  out.print(F(",\"peerSeq\":"));
+  out.print(l.peerSeq);
+  out.print(F(",\"sent\":"));
+  out.print(l.sent);
+  out.print(F(",\"received\":"));
+  out.print(l.received);
+  out.print(F(",\"bad\":"));
+  out.print(l.bad);
+  out.print(F(",\"stale\":"));
+  out.print(l.stale);
+  out.print(F(",\"failovers\":"));
+  out.print(l.failovers);
+  out.print('}');
 }
@@ -0,0 +1,227 @@
+// Configuration store shared by the relay controller sketches.
+//
+// EEPROM is used as a log of records, each holding the current value of one
+// config section plus a sequence number and a CRC. The EEPROM is cut into
+// CONFIG_SLOTS small slots and a record takes as many as its section needs.
+// Saving a section appends a record at the head, which moves on around the
+// EEPROM; a section's newest record that the head is about to reach is
+// copied to the head first. So writes rotate over the whole EEPROM however
+// few sections change, and a record cut short by a reset never destroys the
+// last good copy. At boot the newest valid record of each section wins.
+//
+// Records are written one byte per task() call whenever the EEPROM is idle
+// (a byte takes 3.3 ms to program), so saving never stalls the loop. A
+// section saved again while its record is being written starts the record
+// over, so no record mixes values from before and after a change. Fields
+// appended to the end of a section need no layout bump: a shorter record
+// from before fills the front and the new fields keep their defaults.
+#ifndef RELAY_COMMON_CONFIG_LOG_H
+#define RELAY_COMMON_CONFIG_LOG_H
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#define CONFIG_HEADER_SIZE 4   // seq (2), section, length
+#define CONFIG_SLOTS 128
+#define CONFIG_SLOT_SIZE ((E2END + 1) / CONFIG_SLOTS)   // 8 bytes on the Uno
+#define CONFIG_NO_SLOT 0xFF
+
+// CRC-16/CCITT, bitwise to keep the table out of flash
+inline uint16_t crc16Update(uint16_t crc, uint8_t b) {
+  crc ^= (uint16_t)b << 8;
+  for (uint8_t i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
+
+// Newer of two sequence numbers, allowing for wrap-around
+inline bool seqAfter(uint16_t a, uint16_t b) {
+  return (int16_t)(a - b) > 0;
+}
+
+// Slots taken by a record of len data bytes
+constexpr uint8_t configSlotsFor(uint8_t len) {
+  return (CONFIG_HEADER_SIZE + len + 2 + CONFIG_SLOT_SIZE - 1) / CONFIG_SLOT_SIZE;
+}
+
+template <class Sections>
+constexpr uint8_t configSlotsLive(uint8_t section = 0) {
+  return section == Sections::COUNT ? 0 : configSlotsFor(Sections::size(section)) + configSlotsLive<Sections>(section + 1);
+}
+
+template <class Sections>
+constexpr uint8_t configSlotsMax(uint8_t section = 0, uint8_t most = 0) {
+  return section == Sections::COUNT ? most
+       : configSlotsMax<Sections>(section + 1, configSlotsFor(Sections::size(section)) > most
+                                                   ? configSlotsFor(Sections::size(section)) : most);
+}
+
+// EEPROM address of byte pos of the record starting at slot; records wrap
+// from the last slot to the first
+inline int configAddr(uint8_t slot, uint8_t pos) {
+  return ((uint16_t)slot * CONFIG_SLOT_SIZE + pos) % (CONFIG_SLOTS * CONFIG_SLOT_SIZE);
+}
+
+// The log over the sketch's config sections, which Sections describes:
+//   COUNT          the number of sections
+//   LAYOUT         seeds the CRC, so records written by an older layout no
+//                  longer validate; bump it when a section's layout changes
+//   data(section)  the section's RAM copy
+//   size(section)  its size, constexpr so the log is checked to fit
+template <class Sections>
+class ConfigLog {
+ public:
+  // Free slots kept ahead of the head, enough to move any record out of
+  // its way
+  static constexpr uint8_t reserve() {
+    return configSlotsMax<Sections>();
+  }
+
+  uint8_t live[Sections::COUNT];   // first slot of each section's newest record
+  uint16_t seq;                // sequence number of the newest record
+  uint8_t head;                // slot after the newest record
+  uint8_t dirty[(Sections::COUNT + 7) / 8];   // bitmap of sections waiting to be saved
+  // Record being written
+  bool writing;
+  uint8_t section;
+  uint8_t slot;
+  uint8_t from;                // record being moved, CONFIG_NO_SLOT when saving RAM
+  uint8_t pos;
+  uint16_t crc;
+
+  // Loads the newest valid record of each section over the compiled-in
+  // defaults
+  void restore() {
+    uint16_t sectionSeq[Sections::COUNT];
+    bool any = false;
+    memset(live, CONFIG_NO_SLOT, sizeof(live));
+
+    for (uint8_t s = 0; s < CONFIG_SLOTS; s++) {
+      uint16_t recordSeq;
+      uint8_t id = check(s, recordSeq);
+      if (id == Sections::COUNT) continue;
+      if (live[id] == CONFIG_NO_SLOT || seqAfter(recordSeq, sectionSeq[id])) {
+        live[id] = s;
+        sectionSeq[id] = recordSeq;
+      }
+      if (!any || seqAfter(recordSeq, seq)) {
+        seq = recordSeq;
+        head = (s + configSlotsFor(EEPROM.read(configAddr(s, 3)))) % CONFIG_SLOTS;
+        any = true;
+      }
+    }
+
+    for (uint8_t id = 0; id < Sections::COUNT; id++) {
+      if (live[id] == CONFIG_NO_SLOT) continue;
+      uint8_t* data = (uint8_t*)Sections::data(id);
+      uint8_t len = EEPROM.read(configAddr(live[id], 3));
+      for (uint8_t i = 0; i < len; i++) data[i] = EEPROM.read(configAddr(live[id], CONFIG_HEADER_SIZE + i));
+    }
+  }
+
+  // Queues a section to be written; the newest value at write time is stored
+  void save(uint8_t id) {
+    dirty[id >> 3] |= 1 << (id & 7);
+  }
+
+  bool pending(uint8_t id) const {
+    return dirty[id >> 3] & (1 << (id & 7));
+  }
+
+  // Writes the pending record one byte at a time. A section's RAM copy is
+  // streamed straight to EEPROM; a record moved out of the head's way is
+  // copied from its old slots under a new sequence number. Either way the
+  // CRC covers what was actually written.
+  void task() {
+    if (!eeprom_is_ready()) return;
+
+    if (!writing) {
+      uint8_t id = 0;
+      while (id < Sections::COUNT && !pending(id)) id++;
+      if (id == Sections::COUNT) return;
+
+      // Keep reserve() slots free past the new record. If they are not, the
+      // live record in the way goes first: saved anew if it is waiting to
+      // be, copied as it is otherwise. Its old slots are then free.
+      uint8_t gap;
+      uint8_t next = nextLive(gap);
+      from = CONFIG_NO_SLOT;
+      if (next != Sections::COUNT && gap < configSlotsFor(Sections::size(id)) + reserve()) {
+        id = next;
+        if (!pending(id)) from = live[id];
+      }
+      clear(id);
+      section = id;
+      slot = head;
+      seq++;
+      pos = 0;
+      crc = Sections::LAYOUT;
+      writing = true;
+    } else if (from == CONFIG_NO_SLOT && pending(section)) {
+      // Saved again mid-record: write the newer value from the start
+      clear(section);
+      pos = 0;
+      crc = Sections::LAYOUT;
+    }
+
+    uint8_t len = from == CONFIG_NO_SLOT ? Sections::size(section) : EEPROM.read(configAddr(from, 3));
+    uint8_t b;
+    if (pos == 0) b = seq & 0xFF;
+    else if (pos == 1) b = seq >> 8;
+    else if (pos == 2) b = section;
+    else if (pos == 3) b = len;
+    else if (pos < CONFIG_HEADER_SIZE + len && from != CONFIG_NO_SLOT) b = EEPROM.read(configAddr(from, pos));
+    else if (pos < CONFIG_HEADER_SIZE + len) b = ((uint8_t*)Sections::data(section))[pos - CONFIG_HEADER_SIZE];
+    else if (pos == CONFIG_HEADER_SIZE + len) b = crc & 0xFF;
+    else b = crc >> 8;
+
+    EEPROM.update(configAddr(slot, pos), b);
+    if (pos < CONFIG_HEADER_SIZE + len) crc = crc16Update(crc, b);
+
+    if (++pos == CONFIG_HEADER_SIZE + len + 2) {
+      live[section] = slot;
+      head = (slot + configSlotsFor(len)) % CONFIG_SLOTS;
+      writing = false;
+    }
+  }
+
+ private:
+  static_assert(CONFIG_SLOTS - configSlotsLive<Sections>() >= 2 * configSlotsMax<Sections>(),
+                "EEPROM too small for the config sections: fewer of them, or a bigger board");
+
+  void clear(uint8_t id) {
+    dirty[id >> 3] &= ~(1 << (id & 7));
+  }
+
+  // Validates a record starting at a slot; returns its section or COUNT
+  static uint8_t check(uint8_t s, uint16_t& recordSeq) {
+    uint8_t id = EEPROM.read(configAddr(s, 2));
+    uint8_t len = EEPROM.read(configAddr(s, 3));
+    if (id >= Sections::COUNT || len == 0 || len > Sections::size(id)) return Sections::COUNT;
+
+    uint16_t c = Sections::LAYOUT;
+    for (uint8_t i = 0; i < CONFIG_HEADER_SIZE + len; i++) c = crc16Update(c, EEPROM.read(configAddr(s, i)));
+    if (EEPROM.read(configAddr(s, CONFIG_HEADER_SIZE + len)) != (c & 0xFF) ||
+        EEPROM.read(configAddr(s, CONFIG_HEADER_SIZE + len + 1)) != (c >> 8)) return Sections::COUNT;
+
+    recordSeq = EEPROM.read(configAddr(s, 0)) | (EEPROM.read(configAddr(s, 1)) << 8);
+    return id;
+  }
+
+  // The section whose newest record comes first after the head, and the
+  // free slots up to it
+  uint8_t nextLive(uint8_t& gap) const {
+    uint8_t next = Sections::COUNT;
+    gap = CONFIG_SLOTS;
+    for (uint8_t i = 0; i < Sections::COUNT; i++) {
+      if (live[i] == CONFIG_NO_SLOT) continue;
+      uint8_t d = (live[i] + CONFIG_SLOTS - head) % CONFIG_SLOTS;
+      if (d < gap) {
+        gap = d;
+        next = i;
+      }
+    }
+    return next;
+  }
+};
+
+#endif
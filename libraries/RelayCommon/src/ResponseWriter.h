@@ -0,0 +1,145 @@
+// Buffered, windowed response output shared by the relay controller
+// sketches.
+#ifndef RELAY_COMMON_RESPONSE_WRITER_H
+#define RELAY_COMMON_RESPONSE_WRITER_H
+
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+
+// TX write-coalescing buffer. Print sends F() strings to the client one byte
+// at a time and every client write is its own SPI burst and socket SEND on
+// the W5x00, so responses are collected here and pushed out in full chunks.
+// A full 1460-byte MSS would take most of the free SRAM on an Uno (2 KB)
+// and a sixth of a Mega's (8 KB); 256 bytes already cuts a page from
+// thousands of socket writes to about ten.
+//
+// Only rendered bytes inside the [skip, skip + limit) window reach the
+// sink, a client or a UDP packet. A page bigger than the socket's free TX
+// space is rendered again on a later pass with the window moved on, so no
+// per-connection copy of the page is ever held in RAM. State may change
+// between passes, so resume() also checksums the bytes it renders: if the
+// part before the window no longer matches what was sent, nothing more is
+// sent, rather than a page spliced from two renderings.
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 256
+#endif
+
+class ResponseWriter : public Print {
+ public:
+  unsigned long flushes = 0;   // socket writes issued, i.e. SPI send bursts
+  unsigned long bytes = 0;
+  bool more = false;           // output ran past the end of the window
+  bool changed = false;        // the bytes before the window differ from those sent
+
+  ResponseWriter& begin(Print& s, unsigned long skip = 0, unsigned long limit = 0xFFFFUL) {
+    sink = &s;
+    len = 0;
+    pos = 0;
+    windowStart = skip;
+    windowEnd = skip + limit;
+    more = false;
+    checking = false;
+    changed = false;
+    return *this;
+  }
+
+  // Like begin(), for a later pass over a page whose first skip bytes were
+  // sent with the given checksum
+  ResponseWriter& resume(Print& s, unsigned long skip, unsigned long limit, uint16_t sentSum) {
+    begin(s, skip, limit);
+    checking = true;
+    expected = sentSum;
+    sum = 0;
+    return *this;
+  }
+
+  // Checksum of the bytes up to sent(), for the next resume()
+  uint16_t sentSum() const {
+    return sum;
+  }
+
+  // Offset of the first byte not yet handed to the client
+  unsigned long sent() const {
+    return more ? windowEnd : pos;
+  }
+
+  // Bytes rendered since begin(), inside the window or not
+  unsigned long rendered() const {
+    return pos;
+  }
+
+  size_t write(uint8_t c) override {
+    return put(&c, 1, false);
+  }
+
+  size_t write(const uint8_t* data, size_t n) override {
+    return put(data, n, false);
+  }
+
+  // Copies a PROGMEM block straight into the buffer
+  size_t writeP(PGM_P data, size_t n) {
+    return put((const uint8_t*)data, n, true);
+  }
+
+  void flush() override {
+    if (len == 0 || !sink) return;
+    sink->write(buf, len);
+    flushes++;
+    bytes += len;
+    len = 0;
+  }
+
+  using Print::write;
+
+ private:
+  Print* sink = nullptr;
+  uint8_t buf[TX_BUFFER_SIZE];
+  uint16_t len = 0;
+  unsigned long pos = 0;
+  unsigned long windowStart = 0;
+  unsigned long windowEnd = 0;
+  bool checking = false;
+  uint16_t expected = 0;
+  uint16_t sum = 0;            // Fletcher-style: low byte sums bytes, high byte sums those
+
+  void check(const uint8_t* data, unsigned long from, unsigned long to, bool progmem) {
+    uint8_t a = sum, b = sum >> 8;
+    for (; from < to; from++, data++) {
+      a += progmem ? pgm_read_byte(data) : *data;
+      b += a;
+    }
+    sum = (uint16_t)b << 8 | a;
+  }
+
+  size_t put(const uint8_t* data, size_t n, bool progmem) {
+    unsigned long start = pos;
+    pos += n;
+    if (checking) {
+      // The window closes for good once the part before it is found changed
+      if (start < windowStart) check(data, start, min(pos, windowStart), progmem);
+      if (start <= windowStart && pos >= windowStart && sum != expected) {
+        changed = true;
+        windowEnd = windowStart;
+      }
+      unsigned long from = max(start, windowStart);
+      check(data + (from - start), from, min(pos, windowEnd), progmem);
+    }
+    if (pos > windowEnd) more = true;
+    unsigned long from = max(start, windowStart);
+    unsigned long to = min(pos, windowEnd);
+    if (from >= to) return n;
+
+    data += from - start;
+    size_t left = to - from;
+    while (left) {
+      size_t chunk = min((size_t)(TX_BUFFER_SIZE - len), left);
+      if (progmem) memcpy_P(buf + len, data, chunk);
+      else memcpy(buf + len, data, chunk);
+      len += chunk; data += chunk; left -= chunk;
+      if (len == TX_BUFFER_SIZE) flush();
+    }
+    return n;
+  }
+};
+
+#endif
@@ -0,0 +1,226 @@
+// Web logins and sessions shared by the relay controller sketches.
+//
+// A login is kept only as a salted hash of the user and password; an
+// all-zero hash means none was ever saved and the defaults apply. POST
+// /login checks the credentials against it and opens a session: a random
+// token that the browser sends back as the "session" cookie, or an API
+// client as "Authorization: Bearer <hex>". The sketch decodes the token
+// while the header streams in, so checking a request is one pass over the
+// session table, comparing every slot in full so the time taken says
+// nothing about how much of a token matched. A session ends on /logout or
+// after SESSION_IDLE_MS without a request; opening one with the table full
+// ends the least recently used. A failed login turns the next ones away
+// unchecked for LOGIN_BACKOFF_MIN_MS, doubling with each failure in a row,
+// so guessing is slow and cannot keep the loop hashing.
+#ifndef RELAY_COMMON_SESSIONS_H
+#define RELAY_COMMON_SESSIONS_H
+
+#include <Arduino.h>
+
+#define LOGIN_DEFAULT_USER "admin"
+#define LOGIN_DEFAULT_PASS "1234"
+#define LOGIN_ROUNDS 32               // hash iterations per credential check
+#define LOGIN_FIELD_MAX 32            // user and password, each
+#define LOGIN_BACKOFF_MIN_MS 1000UL
+#define LOGIN_BACKOFF_MAX_MS 32000UL
+#define SESSION_SLOTS 4
+#define SESSION_TOKEN_BYTES 8
+#define SESSION_IDLE_MS 900000UL      // 15 minutes
+
+#define ROTL32(x, b) (uint32_t)(((x) << (b)) | ((x) >> (32 - (b))))
+
+static inline uint32_t sipWord(const uint8_t* p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void sipRound(uint32_t* v) {
+  v[0] += v[1]; v[1] = ROTL32(v[1], 5); v[1] ^= v[0]; v[0] = ROTL32(v[0], 16);
+  v[2] += v[3]; v[3] = ROTL32(v[3], 8); v[3] ^= v[2];
+  v[0] += v[3]; v[3] = ROTL32(v[3], 7); v[3] ^= v[0];
+  v[2] += v[1]; v[1] = ROTL32(v[1], 13); v[1] ^= v[2]; v[2] = ROTL32(v[2], 16);
+}
+
+static inline void sipCompress(uint32_t* v, uint32_t m) {
+  v[3] ^= m;
+  sipRound(v);
+  sipRound(v);
+  v[0] ^= m;
+}
+
+static inline void sipOutput(uint32_t* v, uint8_t* out) {
+  for (uint8_t i = 0; i < 4; i++) sipRound(v);
+  uint32_t x = v[1] ^ v[3];
+  for (uint8_t i = 0; i < 4; i++) out[i] = x >> (8 * i);
+}
+
+// HalfSipHash-2-4 with a 64-bit key and result: a keyed hash built from
+// 32-bit operations, which the AVR handles far faster than SipHash's
+// 64-bit ones. out may overlap data.
+inline void halfSipHash(const uint8_t* key, const uint8_t* data, uint8_t len, uint8_t* out) {
+  uint32_t k0 = sipWord(key), k1 = sipWord(key + 4);
+  uint32_t v[4] = { k0, k1 ^ 0xEE, UINT32_C(0x6C796765) ^ k0, UINT32_C(0x74656462) ^ k1 };
+  uint8_t i = 0;
+  for (; len - i >= 4; i += 4) sipCompress(v, sipWord(data + i));
+  uint32_t last = (uint32_t)len << 24;
+  for (uint8_t j = 0; i + j < len; j++) last |= (uint32_t)data[i + j] << (8 * j);
+  sipCompress(v, last);
+  v[2] ^= 0xEE;
+  sipOutput(v, out);
+  v[1] ^= 0xDD;
+  sipOutput(v, out + 4);
+}
+
+// Compares all len bytes whatever they hold
+inline bool sameBytes(const uint8_t* a, const uint8_t* b, uint8_t len) {
+  uint8_t diff = 0;
+  for (uint8_t i = 0; i < len; i++) diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+inline void printToken(Print& out, const uint8_t* token) {
+  for (uint8_t i = 0; i < SESSION_TOKEN_BYTES; i++) {
+    if (token[i] < 0x10) out.print('0');
+    out.print(token[i], HEX);
+  }
+}
+
+struct Session {
+  uint8_t token[SESSION_TOKEN_BYTES];
+  unsigned long usedAt;        // millis() of the last request
+  bool live;
+};
+
+// The session slots, and the random pool their tokens and login salts are
+// drawn from
+class SessionTable {
+ public:
+  Session slots[SESSION_SLOTS];
+
+  // Fills the random pool at boot from ADC noise and the time the reads take
+  void seed() {
+    for (uint8_t i = 0; i < 64; i++) {
+      uint16_t noise[2] = { (uint16_t)analogRead(i % 6), (uint16_t)micros() };
+      stir(noise, sizeof(noise));
+    }
+  }
+
+  // 8 random bytes from the pool and the time of the call. The pool is then
+  // rekeyed with the output, so one output tells nothing of the next.
+  void random(uint8_t* out) {
+    uint32_t in[2] = { (uint32_t)micros(), draws++ };
+    halfSipHash(pool, (const uint8_t*)in, sizeof(in), out);
+    stir(out, 8);
+  }
+
+  // Opens a session in a free slot, else in the least recently used one
+  int8_t open() {
+    unsigned long now = millis();
+    uint8_t slot = 0;
+    for (uint8_t i = 0; i < SESSION_SLOTS; i++) {
+      Session& s = slots[i];
+      if (!s.live || now - s.usedAt > SESSION_IDLE_MS) { slot = i; break; }
+      if (now - s.usedAt > now - slots[slot].usedAt) slot = i;
+    }
+    random(slots[slot].token);
+    slots[slot].usedAt = now;
+    slots[slot].live = true;
+    return slot;
+  }
+
+  // Slot of the live session holding token, or -1. Every slot is compared
+  // in full; the match, if any, counts as used.
+  int8_t find(const uint8_t* token) {
+    unsigned long now = millis();
+    int8_t found = -1;
+    for (uint8_t i = 0; i < SESSION_SLOTS; i++) {
+      Session& s = slots[i];
+      if (now - s.usedAt > SESSION_IDLE_MS) s.live = false;
+      if (sameBytes(s.token, token, SESSION_TOKEN_BYTES) && s.live) found = i;
+    }
+    if (found >= 0) slots[found].usedAt = now;
+    return found;
+  }
+
+  // Ends every session but keep (-1 ends them all)
+  void closeOthers(int8_t keep) {
+    for (uint8_t i = 0; i < SESSION_SLOTS; i++) {
+      if (i != keep) slots[i].live = false;
+    }
+  }
+
+  uint8_t count() const {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < SESSION_SLOTS; i++) {
+      if (slots[i].live && millis() - slots[i].usedAt <= SESSION_IDLE_MS) n++;
+    }
+    return n;
+  }
+
+ private:
+  uint8_t pool[8];             // random state behind tokens and salts
+  uint32_t draws;
+
+  void stir(const void* data, uint8_t len) {
+    uint8_t next[sizeof(pool)];
+    halfSipHash(pool, (const uint8_t*)data, len, next);
+    memcpy(pool, next, sizeof(next));
+  }
+};
+
+struct LoginSettings {
+  uint8_t salt[8];
+  uint8_t hash[8];
+};
+
+// Salted hash of a user and password, iterated so that guessing from a copy
+// of the EEPROM costs as much per try as a login does
+inline void loginHash(const char* user, const char* pass, const uint8_t* salt, uint8_t* out) {
+  uint8_t key[8];
+  halfSipHash(salt, (const uint8_t*)user, strlen(user), key);
+  halfSipHash(key, (const uint8_t*)pass, strlen(pass), out);
+  for (uint16_t i = 0; i < LOGIN_ROUNDS; i++) halfSipHash(salt, out, 8, out);
+}
+
+inline bool loginCheck(const LoginSettings& login, const char* user, const char* pass) {
+  if (strlen(user) >= LOGIN_FIELD_MAX || strlen(pass) >= LOGIN_FIELD_MAX) return false;
+  uint8_t hash[sizeof(login.hash)];
+  loginHash(user, pass, login.salt, hash);
+  return sameBytes(hash, login.hash, sizeof(hash));
+}
+
+// Replaces the login, under a fresh salt
+inline void loginSet(LoginSettings& login, SessionTable& sessions, const char* user, const char* pass) {
+  sessions.random(login.salt);
+  loginHash(user, pass, login.salt, login.hash);
+}
+
+// Uses the default login until one is saved
+inline void loginBegin(LoginSettings& login, SessionTable& sessions) {
+  const uint8_t none[sizeof(login.hash)] = {};
+  if (sameBytes(login.hash, none, sizeof(none))) loginSet(login, sessions, LOGIN_DEFAULT_USER, LOGIN_DEFAULT_PASS);
+}
+
+// Failed logins in a row, and the backoff they earned
+struct LoginGuard {
+  uint8_t failures;
+  unsigned long openAt;        // millis() from which logins are checked again
+
+  // Whether a login may be checked now; false while backing off after a
+  // failed one
+  bool allowed() const {
+    return !failures || (long)(millis() - openAt) >= 0;
+  }
+
+  // Checks a login, backing off after a failure
+  bool attempt(const LoginSettings& login, const char* user, const char* pass) {
+    if (loginCheck(login, user, pass)) {
+      failures = 0;
+      return true;
+    }
+    if (failures < 8) failures++;
+    openAt = millis() + min(LOGIN_BACKOFF_MIN_MS << (failures - 1), LOGIN_BACKOFF_MAX_MS);
+    return false;
+  }
+};
+
+#endif
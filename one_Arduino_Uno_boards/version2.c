@@ -29,8 +29,41 @@ TimeWindow activeWindow;
 // Relay states
 bool relayStates[4] = {false, false, false, false};
 bool systemActive = false;
-unsigned long lastTimeCheck = 0;
 unsigned long currentSeconds = 0;
+bool outputsActive;       // what the relay pins were last set for
+bool outputStates[4];
+
+// Cooperative scheduler, as in main-version.c: loop() never sleeps, and
+// each pass runs whichever tasks are due. Lateness beyond a task's
+// deadline is counted as a miss; GET /api/loop reports the timing.
+struct Task {
+  void (*run)();
+  uint16_t periodMs;
+  uint16_t deadlineMs;
+  unsigned long due;
+  unsigned long runs;
+  unsigned long misses;
+  uint16_t maxLateMs;
+};
+
+// Loop iteration timing, in microseconds
+struct LoopStats {
+  unsigned long count;
+  unsigned long lastUs;
+  unsigned long maxUs;
+  unsigned long avgUs;   // exponential moving average, 1/16 weight
+};
+LoopStats loopStats;
+
+// The client being served and its request line so far. The line is read
+// as it arrives, so a slow client never holds up the loop. One client is
+// served at a time, the response goes out in one pass and stop() waits for
+// the close; main-version.c has the web server that never waits.
+#define REQUEST_LINE_MAX 96
+#define REQUEST_TIMEOUT_MS 2000
+EthernetClient webClient;
+String requestLine;
+unsigned long requestStartedAt;
 
 void setup() {
   Serial.begin(9600);
@@ -48,33 +81,94 @@ void setup() {
 
   Serial.print("Relay Controller started at ");
   Serial.println(Ethernet.localIP());
+
+  requestLine.reserve(REQUEST_LINE_MAX);
+  startTasks();
 }
 
 void loop() {
-  // Update time tracking
-  if (millis() - lastTimeCheck >= 1000) {
-    lastTimeCheck = millis();
-    currentSeconds++;
-    if (currentSeconds >= 86400) currentSeconds = 0; // Reset after 24 hours
-
-    // Check time window
-    checkTimeWindow();
+  unsigned long started = micros();
+  runTasks();
+  updateLoopStats(micros() - started);
+}
+
+// === Tasks ===
+// The software clock, one second per run
+void taskClock() {
+  currentSeconds++;
+  if (currentSeconds >= 86400) currentSeconds = 0; // Reset after 24 hours
+  checkTimeWindow();
+}
+
+// Reads the request line as it comes in, then answers it
+void taskWeb() {
+  if (!webClient) {
+    webClient = server.available();
+    if (!webClient) return;
+    requestLine = "";
+    requestStartedAt = millis();
+  }
+  while (webClient.available()) {
+    char c = webClient.read();
+    if (c == '\r' || c == '\n') {
+      handleWebRequest(webClient, requestLine);
+      webClient.stop();
+      return;
+    }
+    if (requestLine.length() < REQUEST_LINE_MAX) requestLine += c;
   }
+  if (!webClient.connected() || millis() - requestStartedAt >= REQUEST_TIMEOUT_MS) webClient.stop();
+}
 
-  // Handle web requests
-  EthernetClient client = server.available();
-  if (client) {
-    handleWebRequest(client);
-    client.stop();
+// Writes the outputs only when one changes
+void taskOutputs() {
+  static const uint8_t pins[4] = { RELAY1_PIN, RELAY2_PIN, RELAY3_PIN, RELAY4_PIN };
+  for (uint8_t i = 0; i < 4; i++) {
+    if (systemActive == outputsActive && relayStates[i] == outputStates[i]) continue;
+    outputStates[i] = relayStates[i];
+    digitalWrite(pins[i], systemActive && relayStates[i] ? HIGH : LOW);
   }
+  outputsActive = systemActive;
+}
+
+Task tasks[] = {
+  { taskClock, 1000, 50 },
+  { taskWeb, 0, 0 },
+  { taskOutputs, 0, 0 },
+};
+#define TASK_COUNT (sizeof(tasks) / sizeof(tasks[0]))
 
-  // Update relay outputs
-  digitalWrite(RELAY1_PIN, systemActive && relayStates[0] ? HIGH : LOW);
-  digitalWrite(RELAY2_PIN, systemActive && relayStates[1] ? HIGH : LOW);
-  digitalWrite(RELAY3_PIN, systemActive && relayStates[2] ? HIGH : LOW);
-  digitalWrite(RELAY4_PIN, systemActive && relayStates[3] ? HIGH : LOW);
+// === Task Scheduler ===
+void startTasks() {
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < TASK_COUNT; i++) tasks[i].due = now;
+}
+
+void runTasks() {
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    Task& t = tasks[i];
+    unsigned long now = millis();
+    if ((long)(now - t.due) < 0) continue;
+
+    unsigned long late = now - t.due;
+    if (late > t.maxLateMs) t.maxLateMs = min(late, 0xFFFFUL);
+    if (t.periodMs && late > t.deadlineMs) t.misses++;
+
+    // Keep the period phase-locked; if we fell more than a period behind,
+    // resynchronise instead of running back-to-back catch-up passes.
+    t.due += t.periodMs;
+    if ((long)(now - t.due) >= 0) t.due = now + t.periodMs;
+
+    t.run();
+    t.runs++;
+  }
+}
 
-  delay(100);
+void updateLoopStats(unsigned long us) {
+  loopStats.count++;
+  loopStats.lastUs = us;
+  if (us > loopStats.maxUs) loopStats.maxUs = us;
+  loopStats.avgUs = loopStats.count == 1 ? us : loopStats.avgUs - loopStats.avgUs / 16 + us / 16;
 }
 
 void checkTimeWindow() {
@@ -91,10 +185,15 @@ void checkTimeWindow() {
   digitalWrite(STATUS_LED, systemActive ? HIGH : LOW);
 }
 
-void handleWebRequest(EthernetClient client) {
-  String request = client.readStringUntil('\r');
+void handleWebRequest(EthernetClient& client, const String& request) {
   client.flush();
 
+  // Scheduler timing
+  if (request.indexOf("GET /api/loop") != -1) {
+    sendLoopStats(client);
+    return;
+  }
+
   // Process relay commands
   if (request.indexOf("GET /relay1/on") != -1) relayStates[0] = true;
   if (request.indexOf("GET /relay1/off") != -1) relayStates[0] = false;
@@ -209,6 +308,34 @@ void handleWebRequest(EthernetClient client) {
   client.println("</div></body></html>");
 }
 
+// Loop iteration stats plus per-task lateness and misses, as JSON
+void sendLoopStats(EthernetClient& client) {
+  client.println(F("HTTP/1.1 200 OK"));
+  client.println(F("Content-Type: application/json"));
+  client.println(F("Connection: close"));
+  client.println();
+  client.print(F("{\"loops\":"));
+  client.print(loopStats.count);
+  client.print(F(",\"lastUs\":"));
+  client.print(loopStats.lastUs);
+  client.print(F(",\"avgUs\":"));
+  client.print(loopStats.avgUs);
+  client.print(F(",\"maxUs\":"));
+  client.print(loopStats.maxUs);
+  client.print(F(",\"tasks\":["));
+  for (uint8_t i = 0; i < TASK_COUNT; i++) {
+    if (i) client.print(',');
+    client.print(F("{\"runs\":"));
+    client.print(tasks[i].runs);
+    client.print(F(",\"maxLateMs\":"));
+    client.print(tasks[i].maxLateMs);
+    client.print(F(",\"misses\":"));
+    client.print(tasks[i].misses);
+    client.print('}');
+  }
+  client.println(F("]}"));
+}
+
 String formatTime(uint8_t hours, uint8_t minutes) {
   String timeStr = "";
   if (hours < 10) timeStr += "0";
@@ -0,0 +1,66 @@
+// Throughput benchmark: drives a sketch's web server with the load
+// generator and prints one report line per scenario. Built once per sketch
+// (see the Makefile), which defines one of the BENCH_ profiles below.
+//
+// Latency is in simulated milliseconds at one loop pass per millisecond,
+// so it counts passes, not AVR cycles; SPI bytes follow the W5x00 framing
+// in mock/Sim.h; heap figures are for the simulated AVR heap; host us/req
+// is the host CPU time spent per request, a rough guide to the work done.
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "harness.h"
+
+#if defined(BENCH_MAIN)
+#define BENCH_NAME "main-version"
+#define BENCH_LOGIN
+#define BENCH_KEEPALIVE
+#define BENCH_PATHS "/api/state", "/relay1/on", "/api/relays", "/relay1/off", "/metrics"
+#elif defined(BENCH_VERSION1)
+#define BENCH_NAME "version1"
+#define BENCH_PATHS "/relay1/on", "/", "/relay1/off"
+#elif defined(BENCH_VERSION2)
+#define BENCH_NAME "version2"
+#define BENCH_PATHS "/relay1/on", "/", "/relay1/off"
+#elif defined(BENCH_TWO)
+#define BENCH_NAME "two-board"
+#define BENCH_LOGIN
+#define BENCH_PATHS "/on", "/", "/off", "/watchdog"
+#endif
+
+void setup();
+
+static void report(const char* scenario, const LoadReport& r) {
+  sim::HeapStats heap = sim::heapStats();
+  unsigned long n = r.requests ? r.requests : 1;
+  printf("%-14s %-22s %6lu %5lu %6lu %6lu %6lu %8lu %7lu %6lu %6zu %6zu %7lu %8.1f\n", BENCH_NAME, scenario,
+         r.requests, r.failures, r.latency(0.5), r.latency(0.95), r.latency(1.0), r.spiBytes / n,
+         r.socketWrites / n, r.blockedMs, heap.peak, heap.freeBlocks, r.passes / n, r.hostSeconds * 1e6 / n);
+}
+
+int main(int argc, char** argv) {
+  unsigned long total = argc > 1 ? atol(argv[1]) : 300;
+  if (argc > 2 && std::string(argv[2]) == "--header") {
+    printf("%-14s %-22s %6s %5s %6s %6s %6s %8s %7s %6s %6s %6s %7s %8s\n", "sketch", "scenario", "reqs", "fail",
+           "p50ms", "p95ms", "maxms", "spiB/req", "wr/req", "blkms", "heapPk", "holes", "pass/rq", "hostus/rq");
+  }
+  setup();
+  sim::pass(100);
+
+  std::string auth;
+#ifdef BENCH_LOGIN
+  // Older revisions have no login; they are benchmarked without a session
+  auth = sessionCookie();
+#endif
+  std::vector<std::string> page = { "GET / HTTP/1.1\r\nHost: board\r\n" + auth + "\r\n" };
+  std::vector<std::string> mixed;
+  for (const char* path : { BENCH_PATHS }) mixed.push_back(std::string("GET ") + path + " HTTP/1.1\r\nHost: board\r\n" + auth + "\r\n");
+
+  report("page, 1 client", HttpLoad(page, 1, false).run(total));
+  report("mixed, 3 clients", HttpLoad(mixed, 3, false).run(total));
+  report("mixed, 3 slow clients", HttpLoad(mixed, 3, false, 16).run(total));
+#ifdef BENCH_KEEPALIVE
+  report("mixed, 3 keep-alive", HttpLoad(mixed, 3, true).run(total));
+#endif
+  return 0;
+}
@@ -0,0 +1,266 @@
+// Checks, an HTTP client and a load generator for the host tests. A test
+// includes its sketch (as converted by sketch2cpp.py) and then this file.
+#pragma once
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "Sim.h"
+
+// === Checks ===
+static int testFailures = 0;
+static int testChecks = 0;
+
+#define CHECK(cond) check((cond), __FILE__, __LINE__, #cond)
+#define CHECK_EQ(a, b) checkEqual((long long)(a), (long long)(b), __FILE__, __LINE__, #a " == " #b)
+
+static inline bool check(bool ok, const char* file, int line, const char* what) {
+  testChecks++;
+  if (!ok) {
+    testFailures++;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+  }
+  return ok;
+}
+
+static inline bool checkEqual(long long a, long long b, const char* file, int line, const char* what) {
+  testChecks++;
+  if (a != b) {
+    testFailures++;
+    fprintf(stderr, "%s:%d: check failed: %s (%lld != %lld)\n", file, line, what, a, b);
+  }
+  return a == b;
+}
+
+// Prints the summary line; the process exit status for main()
+static inline int testResult(const char* name) {
+  printf("%s: %d checks, %d failed\n", name, testChecks, testFailures);
+  return testFailures ? 1 : 0;
+}
+
+static inline double hostSeconds() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// === HTTP client ===
+struct HttpResponse {
+  int status = 0;
+  std::string headers;
+  std::string body;
+  bool complete = false;
+  bool closed = false;
+
+  std::string header(const char* name) const {
+    std::string lower = headers, key = std::string("\r\n") + name + ":";
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    size_t at = lower.find(key);
+    if (at == std::string::npos) return "";
+    at += key.size();
+    while (at < headers.size() && headers[at] == ' ') at++;
+    return headers.substr(at, headers.find("\r\n", at) - at);
+  }
+};
+
+// Splits one response off the front of buf once it is complete: by
+// Content-Length, or by the connection closing when there is none
+static inline bool takeResponse(std::string& buf, bool closed, HttpResponse& r) {
+  size_t end = buf.find("\r\n\r\n");
+  if (end == std::string::npos) return false;
+  r.headers = buf.substr(0, end + 2);
+  r.status = atoi(r.headers.c_str() + 9);
+  std::string length = r.header("Content-Length");
+  size_t bodyAt = end + 4;
+  if (!length.empty()) {
+    size_t n = atol(length.c_str());
+    if (buf.size() < bodyAt + n) return false;
+    r.body = buf.substr(bodyAt, n);
+    buf.erase(0, bodyAt + n);
+  } else {
+    if (!closed) return false;
+    r.body = buf.substr(bodyAt);
+    buf.clear();
+  }
+  r.complete = true;
+  r.closed = closed;
+  return true;
+}
+
+// One request on a new connection, served by up to maxPasses loop passes
+static inline HttpResponse httpRequest(const std::string& request, unsigned long maxPasses = 5000) {
+  HttpResponse r;
+  int c = sim::connect(80);
+  if (c < 0) {
+    sim::pass(1);
+    c = sim::connect(80);
+  }
+  if (c < 0) return r;
+  sim::send(c, request);
+  std::string buf;
+  for (unsigned long i = 0; i < maxPasses && !r.complete; i++) {
+    sim::pass(1);
+    buf += sim::receive(c);
+    takeResponse(buf, sim::closed(c), r);
+  }
+  if (!sim::closed(c)) sim::close(c);
+  sim::pass(2);
+  return r;
+}
+
+static inline HttpResponse httpGet(const std::string& path, const std::string& headers = "") {
+  return httpRequest("GET " + path + " HTTP/1.1\r\nHost: board\r\n" + headers + "\r\n");
+}
+
+static inline HttpResponse httpPost(const std::string& path, const std::string& form, const std::string& headers = "") {
+  char length[16];
+  snprintf(length, sizeof(length), "%zu", form.size());
+  return httpRequest("POST " + path + " HTTP/1.1\r\nHost: board\r\nContent-Type: application/x-www-form-urlencoded\r\n" +
+                     "Content-Length: " + length + "\r\n" + headers + "\r\n" + form);
+}
+
+// Logs in with the default account; the Cookie header for later requests
+static inline std::string sessionCookie(const char* user = "admin", const char* pass = "1234") {
+  HttpResponse r = httpPost("/login", std::string("user=") + user + "&pass=" + pass);
+  std::string cookie = r.header("Set-Cookie");
+  size_t end = cookie.find(';');
+  if (cookie.empty()) return "";
+  return "Cookie: " + cookie.substr(0, end) + "\r\n";
+}
+
+// === Load generator ===
+// Clients that each send requests back to back, taking the next one from
+// a list, on one keep-alive connection or a new connection per request.
+// A client writes at most chunk bytes of its request per millisecond, to
+// model slow links. Latency runs from the first byte sent to the last received.
+// Like a browser, a client whose kept-alive connection closes before any of
+// the response arrives sends the request again on a new one: the server may
+// close an idle connection just as the next request is on its way.
+struct LoadReport {
+  unsigned long requests = 0;
+  unsigned long failures = 0;      // closed before a full response
+  unsigned long retries = 0;       // sent again after a kept-alive connection closed
+  unsigned long passes = 0;
+  unsigned long simMs = 0;
+  std::vector<unsigned long> latencyMs;
+  unsigned long spiBytes = 0;
+  unsigned long socketWrites = 0;
+  unsigned long blockedMs = 0;
+  double hostSeconds = 0;
+
+  unsigned long latency(double q) const {
+    if (latencyMs.empty()) return 0;
+    std::vector<unsigned long> v = latencyMs;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(q * v.size()))];
+  }
+};
+
+class HttpLoad {
+ public:
+  HttpLoad(const std::vector<std::string>& requests, unsigned clients, bool keepAlive, size_t chunk = 0)
+      : requests(requests), keepAlive(keepAlive), chunk(chunk), clients(clients) {}
+
+  LoadReport run(unsigned long total, unsigned long maxPasses = 1000000) {
+    LoadReport rep;
+    sim::Board& b = *sim::board;
+    unsigned long spi0 = b.spiBytes, blocked0 = b.blockedMs, ms0 = sim::ms, writes0 = socketWrites();
+    double t0 = hostSeconds();
+    unsigned long started = 0;
+    // The clients act every millisecond, even while a pass blocks
+    sim::peers.push_back([&] {
+      for (Client& c : clients) step(c, rep, started, total);
+    });
+    while (rep.requests + rep.failures < total && rep.passes < maxPasses) {
+      sim::pass(1);
+      rep.passes++;
+    }
+    sim::peers.pop_back();
+    rep.hostSeconds = hostSeconds() - t0;
+    rep.simMs = sim::ms - ms0;
+    rep.spiBytes = b.spiBytes - spi0;
+    rep.blockedMs = b.blockedMs - blocked0;
+    rep.socketWrites = socketWrites() - writes0;
+    for (Client& c : clients) {
+      if (c.conn >= 0 && !sim::closed(c.conn)) sim::close(c.conn);
+    }
+    sim::pass(5);
+    return rep;
+  }
+
+ private:
+  struct Client {
+    int conn = -1;          // sim connection id
+    std::string pending;     // request bytes not yet sent
+    std::string buf;         // response bytes received
+    std::string request;     // the request being served
+    unsigned served = 0;     // responses received on this connection
+    unsigned long startMs = 0;
+    bool busy = false;
+  };
+  std::vector<std::string> requests;
+  bool keepAlive;
+  size_t chunk;
+  std::vector<Client> clients;
+  size_t nextRequest = 0;
+
+  static unsigned long socketWrites() {
+    unsigned long n = 0;
+    for (uint8_t s = 0; s < sim::MAX_SOCKETS; s++) n += sim::board->sockets[s].writes;
+    return n;
+  }
+
+  void step(Client& c, LoadReport& rep, unsigned long& started, unsigned long total) {
+    if (!c.busy) {
+      if (started >= total) return;
+      if (c.conn < 0 || sim::closed(c.conn)) {
+        c.conn = sim::connect(80);
+        if (c.conn < 0) return;    // no listening socket this pass
+        c.buf.clear();
+        c.served = 0;
+      }
+      c.request = requests[nextRequest++ % requests.size()];
+      if (!keepAlive) c.request.insert(c.request.find("\r\n") + 2, "Connection: close\r\n");
+      c.pending = c.request;
+      c.startMs = sim::ms;
+      c.busy = true;
+      started++;
+    } else if (c.conn < 0) {
+      c.conn = sim::connect(80);
+      if (c.conn < 0) return;
+      c.buf.clear();
+      c.served = 0;
+      c.pending = c.request;
+    }
+    if (!c.pending.empty()) {
+      size_t n = chunk ? std::min(chunk, c.pending.size()) : c.pending.size();
+      sim::send(c.conn, c.pending.substr(0, n));
+      c.pending.erase(0, n);
+    }
+    c.buf += sim::receive(c.conn);
+    HttpResponse r;
+    bool closed = sim::closed(c.conn);
+    if (takeResponse(c.buf, closed, r)) {
+      rep.requests++;
+      rep.latencyMs.push_back(sim::ms - c.startMs);
+      c.busy = false;
+      c.served++;
+      if (!keepAlive || closed) {
+        if (!closed) sim::close(c.conn);
+        c.conn = -1;
+      }
+    } else if (closed && c.served && c.buf.empty()) {
+      rep.retries++;
+      sim::close(c.conn);
+      c.conn = -1;
+    } else if (closed) {
+      rep.failures++;
+      c.busy = false;
+      c.conn = -1;
+    }
+  }
+};
@@ -0,0 +1,435 @@
+// Host stand-in for the Arduino core: just enough of the AVR API for the
+// sketches to compile and run against the simulated board in Sim.h.
+#pragma once
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <type_traits>
+#include "Sim.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+// Flash is ordinary memory on the host
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+#define FPSTR(p) (reinterpret_cast<const __FlashStringHelper*>(p))
+#define pgm_read_byte(a) (*(const uint8_t*)(a))
+#define pgm_read_byte_near(a) pgm_read_byte(a)
+#define pgm_read_word(a) (*(const uint16_t*)(a))
+#define pgm_read_word_near(a) pgm_read_word(a)
+#define pgm_read_dword(a) (*(const uint32_t*)(a))
+#define pgm_read_ptr(a) (*(void* const*)(a))
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strlen_P strlen
+#define strchr_P strchr
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcasecmp_P strcasecmp
+#define strncasecmp_P strncasecmp
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+
+// The board: an Uno (ATmega328P) unless the build defines
+// __AVR_ATmega2560__, as the Mega 2560's toolchain does
+#ifdef __AVR_ATmega2560__
+#define RAMEND 0x21FF
+#define E2END 0xFFF
+#else
+#define RAMEND 0x8FF
+#define E2END 0x3FF
+#endif
+
+inline unsigned long millis() { return sim::ms; }
+inline unsigned long micros() { return sim::ms * 1000 + sim::us; }
+inline void delay(unsigned long ms) { sim::block(ms); }
+inline void delayMicroseconds(unsigned int) {}
+inline void yield() {}
+
+inline void pinMode(uint8_t pin, uint8_t mode) { sim::pinMode(pin, mode); }
+inline void digitalWrite(uint8_t pin, uint8_t value);
+inline int digitalRead(uint8_t pin) { return sim::board->pins[pin]; }
+inline int analogRead(uint8_t pin) { return (pin * 131 + sim::ms * 7 + sim::us) & 0x3FF; }
+
+inline long random(long max) { return max > 0 ? rand() % max : 0; }
+inline long random(long min, long max) { return max > min ? min + rand() % (max - min) : min; }
+inline void randomSeed(unsigned long seed) { srand(seed); }
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+// External interrupts by the board's numbering, and the EIFR flag bit of
+// each: the Mega's pins 2 and 3 are INT4 and INT5
+#ifdef __AVR_ATmega2560__
+inline int digitalPinToInterrupt(uint8_t pin) {
+  return pin == 2 ? 0 : pin == 3 ? 1 : pin >= 18 && pin <= 21 ? 23 - pin : -1;
+}
+inline uint8_t interruptFlag(int n) { return n < 2 ? 4 + n : n - 2; }
+#else
+inline int digitalPinToInterrupt(uint8_t pin) { return pin == 2 ? 0 : pin == 3 ? 1 : -1; }
+inline uint8_t interruptFlag(int n) { return n; }
+#endif
+#define INTF0 0
+#define INTF1 1
+#define INTF2 2
+#define INTF3 3
+#define INTF4 4
+#define INTF5 5
+#define _BV(b) (1 << (b))
+
+// EIFR: a falling edge on an external interrupt pin latches its flag, and
+// writing a 1 to a flag clears it
+struct FlagRegister {
+  uint8_t bits;
+  FlagRegister& operator=(uint8_t clear) {
+    bits &= ~clear;
+    return *this;
+  }
+  operator uint8_t() const { return bits; }
+};
+extern FlagRegister EIFR;
+
+// A flag still latched when the interrupt is enabled runs the handler at
+// once, for an edge that came before
+inline void attachInterrupt(int n, void (*isr)(), int) {
+  sim::attachInterrupt(n, isr);
+  uint8_t flag = _BV(interruptFlag(n));
+  if (EIFR & flag) {
+    EIFR = flag;
+    isr();
+  }
+}
+inline void detachInterrupt(int n) { sim::attachInterrupt(n, nullptr); }
+
+inline void digitalWrite(uint8_t pin, uint8_t value) {
+  int n = digitalPinToInterrupt(pin);
+  if (n >= 0 && sim::board->pins[pin] && !value) EIFR.bits |= _BV(interruptFlag(n));
+  sim::digitalWrite(pin, value);
+}
+
+template <class T, class U> auto min(T a, U b) -> typename std::common_type<T, U>::type { return a < b ? a : b; }
+template <class T, class U> auto max(T a, U b) -> typename std::common_type<T, U>::type { return a > b ? a : b; }
+#define constrain(x, lo, hi) ((x) < (lo) ? (lo) : ((x) > (hi) ? (hi) : (x)))
+#define bit(b) (1UL << (b))
+#define bitRead(v, b) (((v) >> (b)) & 1)
+#define bitSet(v, b) ((v) |= (1UL << (b)))
+#define bitClear(v, b) ((v) &= ~(1UL << (b)))
+#define bitWrite(v, b, x) ((x) ? bitSet(v, b) : bitClear(v, b))
+
+// I/O registers the sketches touch directly
+extern volatile uint8_t PORTB, PORTD, PORTE, PORTG, PORTH, DDRB, DDRD, PINB, PIND, SREG;
+
+// Each digital pin's port and bit, as the board's core maps them, for the
+// pins 0-13 and the Mega's SPI pins 50-53; tests check a pin through its
+// port register with these
+#define NOT_A_PORT 0
+enum { PB = 2, PD = 4, PE = 5, PG = 7, PH = 8 };   // the core's port numbers
+
+inline volatile uint8_t* portOutputRegister(uint8_t port) {
+  return port == PB ? &PORTB : port == PD ? &PORTD : port == PE ? &PORTE : port == PG ? &PORTG : port == PH ? &PORTH : nullptr;
+}
+
+#ifdef __AVR_ATmega2560__
+inline uint8_t digitalPinToPort(uint8_t pin) {
+  static const uint8_t ports[14] = { PE, PE, PE, PE, PG, PE, PH, PH, PH, PH, PB, PB, PB, PB };
+  return pin < 14 ? ports[pin] : pin >= 50 && pin <= 53 ? PB : NOT_A_PORT;
+}
+inline uint8_t digitalPinToBitMask(uint8_t pin) {
+  static const uint8_t bits[14] = { 0, 1, 4, 5, 5, 3, 3, 4, 5, 6, 4, 5, 6, 7 };
+  return pin < 14 ? 1 << bits[pin] : pin >= 50 && pin <= 53 ? 1 << (53 - pin) : 0;
+}
+#else
+inline uint8_t digitalPinToPort(uint8_t pin) { return pin < 8 ? PD : pin < 14 ? PB : NOT_A_PORT; }
+inline uint8_t digitalPinToBitMask(uint8_t pin) { return pin < 8 ? 1 << pin : pin < 14 ? 1 << (pin - 8) : 0; }
+#endif
+
+// Stack pointer and heap bounds, inside sim::sram
+#define SP ((uintptr_t)sim::stackPointer)
+extern "C" {
+extern void* __brkval;
+extern uint8_t __heap_start;
+}
+
+class Print;
+
+class Printable {
+ public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print& p) const = 0;
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* data, size_t n) {
+    size_t done = 0;
+    while (n--) done += write(*data++);
+    return done;
+  }
+  size_t write(const char* s) { return s ? write((const uint8_t*)s, strlen(s)) : 0; }
+  size_t write(const char* s, size_t n) { return write((const uint8_t*)s, n); }
+  virtual void flush() {}
+
+  size_t print(const __FlashStringHelper* s) { return write((const char*)s); }
+  size_t print(const char* s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(unsigned char v, int base = DEC) { return number(v, base); }
+  size_t print(int v, int base = DEC) { return signedNumber(v, base); }
+  size_t print(unsigned int v, int base = DEC) { return number(v, base); }
+  size_t print(long v, int base = DEC) { return signedNumber(v, base); }
+  size_t print(unsigned long v, int base = DEC) { return number(v, base); }
+  size_t print(double v, int digits = 2) {
+    char buf[40];
+    snprintf(buf, sizeof(buf), "%.*f", digits, v);
+    return write(buf);
+  }
+  size_t print(const Printable& p) { return p.printTo(*this); }
+  size_t print(const class String& s);
+
+  size_t println() { return write("\r\n"); }
+  template <class T> size_t println(T v) { return print(v) + println(); }
+  template <class T> size_t println(T v, int base) { return print(v, base) + println(); }
+
+ private:
+  size_t signedNumber(long v, int base) {
+    if (v < 0 && base == DEC) return print('-') + number(-(unsigned long)v, base);
+    return number((unsigned long)v, base);
+  }
+  size_t number(unsigned long v, int base) {
+    // AVR longs are 32 bits; keep negative ints in hex printing 32-bit wide
+    v &= 0xFFFFFFFFUL;
+    char buf[36];
+    char* p = buf + sizeof(buf) - 1;
+    *p = '\0';
+    do {
+      uint8_t d = v % base;
+      *--p = d < 10 ? '0' + d : 'A' + d - 10;
+      v /= base;
+    } while (v);
+    return write(p);
+  }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  void setTimeout(unsigned long ms) { timeout = ms; }
+  size_t readBytes(char* buf, size_t n) {
+    size_t i = 0;
+    while (i < n && available()) buf[i++] = read();
+    return i;
+  }
+  size_t readBytes(uint8_t* buf, size_t n) { return readBytes((char*)buf, n); }
+  class String readStringUntil(char terminator);
+
+ protected:
+  unsigned long timeout = 1000;
+};
+
+// Arduino String, allocated on the simulated AVR heap so that fragmentation
+// shows up in sim::heapStats()
+class String {
+ public:
+  String(const char* s = "") { assign(s ? s : "", s ? strlen(s) : 0); }
+  String(const __FlashStringHelper* s) : String((const char*)s) {}
+  String(const String& s) { assign(s.c_str(), s.len); }
+  String(char c) { assign(&c, 1); }
+  String(int v, int base = DEC) { number(v, base); }
+  String(unsigned int v, int base = DEC) { number(v, base); }
+  String(long v, int base = DEC) { number(v, base); }
+  String(unsigned long v, int base = DEC) { number((long)v, base); }
+  ~String() { sim::heapFree(buf); }
+
+  String& operator=(const String& s) {
+    if (this != &s) assign(s.c_str(), s.len);
+    return *this;
+  }
+  String& operator+=(const String& s) { return append(s.c_str(), s.len); }
+  String& operator+=(const char* s) { return append(s, strlen(s)); }
+  String& operator+=(char c) { return append(&c, 1); }
+  String& operator+=(int v) { return *this += String(v); }
+  String& operator+=(unsigned int v) { return *this += String(v); }
+  String& operator+=(long v) { return *this += String(v); }
+  String& operator+=(unsigned long v) { return *this += String(v); }
+  friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, const char* b) { String r(a); r += b; return r; }
+  friend String operator+(const char* a, const String& b) { String r(a); r += b; return r; }
+
+  bool operator==(const String& s) const { return len == s.len && !memcmp(c_str(), s.c_str(), len); }
+  bool operator==(const char* s) const { return strcmp(c_str(), s) == 0; }
+  bool operator!=(const String& s) const { return !(*this == s); }
+  bool operator!=(const char* s) const { return !(*this == s); }
+  char operator[](unsigned i) const { return i < len ? buf[i] : 0; }
+
+  unsigned length() const { return len; }
+  const char* c_str() const { return buf ? buf : ""; }
+  void reserve(unsigned n) { grow(n); }
+  int indexOf(char c, unsigned from = 0) const {
+    const char* p = from < len ? strchr(c_str() + from, c) : nullptr;
+    return p ? p - c_str() : -1;
+  }
+  int indexOf(const char* s, unsigned from = 0) const {
+    const char* p = from <= len ? strstr(c_str() + from, s) : nullptr;
+    return p ? p - c_str() : -1;
+  }
+  int indexOf(const String& s, unsigned from = 0) const { return indexOf(s.c_str(), from); }
+  bool startsWith(const char* s) const { return strncmp(c_str(), s, strlen(s)) == 0; }
+  String substring(unsigned from) const { return substring(from, len); }
+  String substring(unsigned from, unsigned to) const {
+    if (from > to) { unsigned t = from; from = to; to = t; }
+    if (to > len) to = len;
+    String r;
+    if (from < to) r.assign(buf + from, to - from);
+    return r;
+  }
+  long toInt() const { return atol(c_str()); }
+  float toFloat() const { return (float)atof(c_str()); }
+  void trim() {
+    unsigned a = 0, b = len;
+    while (a < b && isspace((unsigned char)buf[a])) a++;
+    while (b > a && isspace((unsigned char)buf[b - 1])) b--;
+    String r = substring(a, b);
+    *this = r;
+  }
+  void replace(const char* from, const char* to) {
+    String r;
+    size_t n = strlen(from);
+    for (unsigned i = 0; i < len;) {
+      if (n && strncmp(buf + i, from, n) == 0) { r += to; i += n; }
+      else r += buf[i++];
+    }
+    *this = r;
+  }
+
+ private:
+  char* buf = nullptr;
+  unsigned len = 0;
+  unsigned capacity = 0;
+
+  bool grow(unsigned n) {
+    if (buf && capacity >= n) return true;
+    char* p = (char*)sim::heapRealloc(buf, n + 1);
+    if (!p) return false;
+    if (!buf) p[0] = '\0';
+    buf = p;
+    capacity = n;
+    return true;
+  }
+  void assign(const char* s, unsigned n) {
+    if (!grow(n)) return;
+    memmove(buf, s, n);
+    buf[n] = '\0';
+    len = n;
+  }
+  String& append(const char* s, unsigned n) {
+    if (!grow(len + n)) return *this;
+    memmove(buf + len, s, n);
+    len += n;
+    buf[len] = '\0';
+    return *this;
+  }
+  void number(long v, int base) {
+    char tmp[36];
+    if (base == DEC) snprintf(tmp, sizeof(tmp), "%ld", v);
+    else snprintf(tmp, sizeof(tmp), base == HEX ? "%lx" : "%lo", (unsigned long)v & 0xFFFFFFFFUL);
+    assign(tmp, strlen(tmp));
+  }
+};
+
+inline size_t Print::print(const String& s) { return write(s.c_str()); }
+
+inline String Stream::readStringUntil(char terminator) {
+  // The core's readStringUntil() waits up to the stream timeout for each
+  // byte; here the wait shows up as blocked time on the simulated clock
+  String s;
+  for (;;) {
+    if (!available()) {
+      sim::block(timeout);
+      if (!available()) break;
+    }
+    int c = read();
+    if (c < 0 || c == terminator) break;
+    s += (char)c;
+  }
+  return s;
+}
+
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) override {
+    sim::board->serial += (char)c;
+    return 1;
+  }
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  operator bool() { return true; }
+};
+extern HardwareSerial Serial;
+
+class IPAddress : public Printable {
+ public:
+  IPAddress() { memset(a, 0, 4); }
+  IPAddress(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) { a[0] = b0; a[1] = b1; a[2] = b2; a[3] = b3; }
+  IPAddress(uint32_t v) { memcpy(a, &v, 4); }
+  IPAddress(const uint8_t* p) { memcpy(a, p, 4); }
+  uint8_t operator[](int i) const { return a[i]; }
+  uint8_t& operator[](int i) { return a[i]; }
+  operator uint32_t() const {
+    uint32_t v;
+    memcpy(&v, a, 4);
+    return v;
+  }
+  bool operator==(const IPAddress& o) const { return memcmp(a, o.a, 4) == 0; }
+  bool operator==(const uint8_t* p) const { return memcmp(a, p, 4) == 0; }
+  bool operator!=(const IPAddress& o) const { return !(*this == o); }
+  const uint8_t* raw() const { return a; }
+  bool fromString(const char* s) {
+    unsigned v[4];
+    char end;
+    if (sscanf(s, "%u.%u.%u.%u%c", &v[0], &v[1], &v[2], &v[3], &end) != 4) return false;
+    for (int i = 0; i < 4; i++) {
+      if (v[i] > 255) return false;
+      a[i] = v[i];
+    }
+    return true;
+  }
+  size_t printTo(Print& p) const override {
+    size_t n = 0;
+    for (int i = 0; i < 4; i++) {
+      n += p.print(a[i]);
+      if (i < 3) n += p.print('.');
+    }
+    return n;
+  }
+
+ private:
+  uint8_t a[4];
+};
+
+void setup();
+void loop();
@@ -0,0 +1,14 @@
+#pragma once
+#include "Arduino.h"
+
+struct EEPROMClass {
+  uint8_t read(int at) { return sim::eepromRead(at); }
+  void write(int at, uint8_t value) { sim::eepromWrite(at, value); }
+  void update(int at, uint8_t value) {
+    if (sim::eepromRead(at) != value) sim::eepromWrite(at, value);
+  }
+  uint16_t length() { return E2END + 1; }
+};
+extern EEPROMClass EEPROM;
+
+inline bool eeprom_is_ready() { return sim::eepromReady(); }
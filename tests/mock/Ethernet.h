@@ -0,0 +1,152 @@
+// Ethernet library (W5100, 4 sockets) over the simulated chip in Sim.h.
+// Ethernet2.h reuses it for the W5500 with 8 sockets.
+#pragma once
+#include "Arduino.h"
+#include "Client.h"
+#include "utility/socket.h"
+
+class EthernetClass {
+ public:
+  // Port of the EthernetServer owning each socket
+  struct ServerPorts {
+    uint16_t& operator[](uint8_t s) { return sim::board->serverPort[s]; }
+  };
+  static ServerPorts _server_port;
+
+  int begin(uint8_t* mac) {
+    (void)mac;
+    attach();
+    return 1;
+  }
+  void begin(uint8_t* mac, IPAddress ip) { begin(mac, ip, IPAddress(ip[0], ip[1], ip[2], 1)); }
+  void begin(uint8_t* mac, IPAddress ip, IPAddress dns) { begin(mac, ip, dns, IPAddress(ip[0], ip[1], ip[2], 1)); }
+  void begin(uint8_t* mac, IPAddress ip, IPAddress dns, IPAddress gateway) {
+    begin(mac, ip, dns, gateway, IPAddress(255, 255, 255, 0));
+  }
+  void begin(uint8_t*, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet) {
+    attach();
+    memcpy(sim::board->ip, ip.raw(), 4);
+    dnsAddress = dns;
+    gatewayAddress = gateway;
+    subnetAddress = subnet;
+  }
+  int maintain() { return 0; }
+  IPAddress localIP() { return IPAddress(sim::board->ip); }
+  IPAddress subnetMask() { return subnetAddress; }
+  IPAddress gatewayIP() { return gatewayAddress; }
+  IPAddress dnsServerIP() { return dnsAddress; }
+
+ private:
+  IPAddress dnsAddress, gatewayAddress, subnetAddress;
+  void attach() { sim::board->socketCount = MAX_SOCK_NUM; }
+};
+static EthernetClass Ethernet;
+
+class EthernetClient : public Client {
+ public:
+  EthernetClient() : sock(MAX_SOCK_NUM) {}
+  EthernetClient(uint8_t s) : sock(s) {}
+
+  uint8_t status() { return sock == MAX_SOCK_NUM ? sim::SOCK_CLOSED : sim::readStatus(sock); }
+  int connect(IPAddress, uint16_t) override { return 0; }
+  uint8_t connected() override {
+    if (sock == MAX_SOCK_NUM) return 0;
+    uint8_t s = status();
+    return !(s == sim::SOCK_LISTEN || s == sim::SOCK_CLOSED || s == sim::SOCK_FIN_WAIT ||
+             (s == sim::SOCK_CLOSE_WAIT && !available()));
+  }
+  int available() override {
+    if (sock == MAX_SOCK_NUM) return 0;
+    sim::spiBurst(2);
+    sim::spiBurst(2);
+    return sim::board->sockets[sock].rx.size();
+  }
+  int read() override {
+    uint8_t b;
+    return read(&b, 1) > 0 ? b : -1;
+  }
+  int read(uint8_t* buf, size_t n) {
+    if (sock == MAX_SOCK_NUM) return -1;
+    int got = sim::receiveSocket(sock, buf, n);
+    return got > 0 ? got : -1;
+  }
+  int peek() override {
+    if (sock == MAX_SOCK_NUM || sim::board->sockets[sock].rx.empty()) return -1;
+    return (uint8_t)sim::board->sockets[sock].rx[0];
+  }
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t* buf, size_t n) override {
+    if (sock == MAX_SOCK_NUM) return 0;
+    return sim::sendSocket(sock, buf, n);
+  }
+  using Print::write;
+  void flush() override {}
+
+  // Sends FIN and waits up to a second for the socket to close, as the
+  // library does; the wait is counted as blocked time
+  void stop() override {
+    if (sock == MAX_SOCK_NUM) return;
+    sim::disconnectSocket(sock);
+    sim::Socket& s = sim::board->sockets[sock];
+    if (s.status == sim::SOCK_FIN_WAIT) {
+      unsigned long wait = s.closeAt - sim::ms;
+      sim::block(wait < 1000 ? wait : 1000);
+    }
+    if (s.status != sim::SOCK_CLOSED) sim::closeSocket(sock);
+    sim::board->serverPort[sock] = 0;
+    sock = MAX_SOCK_NUM;
+  }
+  operator bool() override { return sock != MAX_SOCK_NUM; }
+  bool operator==(const EthernetClient& o) const { return sock == o.sock; }
+  bool operator!=(const EthernetClient& o) const { return sock != o.sock; }
+  uint8_t getSocketNumber() const { return sock; }
+  IPAddress remoteIP() { return IPAddress(sim::board->sockets[sock].peerIp); }
+  uint16_t remotePort() { return sim::board->sockets[sock].peerPort; }
+
+ private:
+  uint8_t sock;
+};
+
+class EthernetServer : public Print {
+ public:
+  EthernetServer(uint16_t p) : port(p) {}
+
+  void begin() {
+    for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+      if (sim::readStatus(s) == sim::SOCK_CLOSED) {
+        sim::openSocket(s, sim::SOCK_LISTEN, port);
+        sim::board->serverPort[s] = port;
+        return;
+      }
+    }
+  }
+
+  // As the library: a connected socket with data waiting, after making
+  // sure a socket still listens. Sockets the peer closed with nothing left
+  // to read are stopped here, blocking.
+  EthernetClient available() {
+    bool listening = false;
+    for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+      if (sim::board->serverPort[s] != port) continue;
+      uint8_t status = sim::readStatus(s);
+      if (status == sim::SOCK_LISTEN) listening = true;
+      else if (status == sim::SOCK_CLOSE_WAIT && !EthernetClient(s).available()) EthernetClient(s).stop();
+    }
+    if (!listening) begin();
+
+    for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+      if (sim::board->serverPort[s] != port) continue;
+      uint8_t status = sim::readStatus(s);
+      if ((status == sim::SOCK_ESTABLISHED || status == sim::SOCK_CLOSE_WAIT) && EthernetClient(s).available()) {
+        return EthernetClient(s);
+      }
+    }
+    return EthernetClient(MAX_SOCK_NUM);
+  }
+
+  size_t write(uint8_t) override { return 1; }
+  using Print::write;
+
+ private:
+  uint16_t port;
+};
@@ -0,0 +1,4 @@
+// Ethernet2 library: the W5500, with 8 sockets
+#pragma once
+#define MAX_SOCK_NUM 8
+#include "Ethernet.h"
@@ -0,0 +1,90 @@
+#pragma once
+#include "Ethernet.h"
+
+class EthernetUDP : public Stream {
+ public:
+  uint8_t begin(uint16_t port) {
+    for (uint8_t s = 0; s < MAX_SOCK_NUM; s++) {
+      if (sim::readStatus(s) == sim::SOCK_CLOSED) {
+        sim::openSocket(s, sim::SOCK_UDP, port);
+        sim::board->serverPort[s] = 0;
+        sock = s;
+        localPort = port;
+        return 1;
+      }
+    }
+    return 0;
+  }
+  void stop() {
+    if (sock == MAX_SOCK_NUM) return;
+    sim::closeSocket(sock);
+    sock = MAX_SOCK_NUM;
+  }
+
+  int beginPacket(IPAddress ip, uint16_t port) {
+    memcpy(out.ip, ip.raw(), 4);
+    out.port = port;
+    out.localPort = localPort;
+    out.data.clear();
+    return sock != MAX_SOCK_NUM;
+  }
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t* buf, size_t n) override {
+    sim::spiBurst(n);
+    out.data.append((const char*)buf, n);
+    return n;
+  }
+  using Print::write;
+  int endPacket() {
+    if (sock == MAX_SOCK_NUM) return 0;
+    sim::spiBurst(4);   // destination address
+    sim::spiBurst(2);   // port
+    sim::spiBurst(1);   // SEND command
+    sim::board->udpOut.push_back(out);
+    return 1;
+  }
+
+  // Discards the rest of the current packet and takes the next one
+  int parsePacket() {
+    in.clear();
+    if (sock == MAX_SOCK_NUM) return 0;
+    sim::spiBurst(2);
+    auto& q = sim::board->udpIn;
+    for (auto it = q.begin(); it != q.end(); ++it) {
+      if (it->localPort != localPort) continue;
+      in = it->data;
+      memcpy(remoteIp, it->ip, 4);
+      fromPort = it->port;
+      q.erase(it);
+      sim::spiBurst(8);   // packet header
+      return in.size();
+    }
+    return 0;
+  }
+  int available() override { return in.size(); }
+  int read() override {
+    uint8_t b;
+    return read(&b, 1) > 0 ? b : -1;
+  }
+  int read(uint8_t* buf, size_t n) {
+    size_t k = n < in.size() ? n : in.size();
+    if (!k) return -1;
+    memcpy(buf, in.data(), k);
+    in.erase(0, k);
+    sim::spiBurst(k);
+    return k;
+  }
+  int read(char* buf, size_t n) { return read((uint8_t*)buf, n); }
+  int peek() override { return in.empty() ? -1 : (uint8_t)in[0]; }
+  void flush() override {}
+  IPAddress remoteIP() { return IPAddress(remoteIp); }
+  uint16_t remotePort() { return fromPort; }
+
+ private:
+  uint8_t sock = MAX_SOCK_NUM;
+  uint16_t localPort = 0;
+  sim::Datagram out = {};
+  std::string in;
+  uint8_t remoteIp[4] = {};
+  uint16_t fromPort = 0;
+};
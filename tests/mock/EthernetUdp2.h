@@ -0,0 +1,3 @@
+#pragma once
+#include "Ethernet2.h"
+#include "EthernetUdp.h"
@@ -0,0 +1,73 @@
+// ICMPPing library: echoes on a raw socket, answered by the board's ping
+// callback (round trip in ms, or -1 for a lost echo)
+#pragma once
+#include "Ethernet.h"
+#include "utility/w5100.h"
+
+enum Status { SUCCESS = 0, SEND_TIMEOUT, NO_RESPONSE, BAD_RESPONSE, ASYNC_SENT };
+
+struct ICMPEcho {
+  uint16_t id;
+  uint16_t seq;
+  unsigned long time;   // millis() when sent
+};
+
+struct ICMPEchoReply {
+  ICMPEcho data;
+  uint8_t ttl;
+  Status status;
+  IPAddress addr;
+};
+
+class ICMPPing {
+ public:
+  ICMPPing(SOCKET s, uint8_t id) : sock(s), id(id) {}
+
+  static void setTimeout(uint16_t ms) { timeout() = ms; }
+  static uint16_t getTimeout() { return timeout(); }
+
+  // Opens the raw socket whatever it was doing, as the library does
+  bool asyncStart(const IPAddress& addr, int, ICMPEchoReply& reply) {
+    if (sim::readStatus(sock) != sim::SOCK_CLOSED) sim::board->socketClobbers++;
+    sim::openSocket(sock, sim::SOCK_IPRAW, 0);
+    sim::spiBurst(16);
+    reply.addr = addr;
+    reply.status = ASYNC_SENT;
+    reply.data.id = id;
+    reply.data.time = millis();
+    int rtt = sim::board->ping ? sim::board->ping(addr.raw()) : -1;
+    dueAt = millis() + (rtt < 0 || rtt > timeout() ? timeout() : rtt);
+    ok = rtt >= 0 && rtt <= timeout();
+    return true;
+  }
+
+  // Blocking form: up to nRetries echoes, each waited for in full
+  ICMPEchoReply operator()(const IPAddress& addr, int nRetries) {
+    ICMPEchoReply reply;
+    for (int i = 0; i < nRetries; i++) {
+      asyncStart(addr, 0, reply);
+      sim::block(dueAt - millis());
+      asyncComplete(reply);
+      if (reply.status == SUCCESS) break;
+    }
+    sim::closeSocket(sock);
+    return reply;
+  }
+
+  bool asyncComplete(ICMPEchoReply& reply) {
+    sim::spiBurst(2);
+    if ((long)(millis() - dueAt) < 0) return false;
+    reply.status = ok ? SUCCESS : NO_RESPONSE;
+    return true;
+  }
+
+ private:
+  SOCKET sock;
+  uint8_t id;
+  unsigned long dueAt = 0;
+  bool ok = false;
+  static uint16_t& timeout() {
+    static uint16_t ms = 1000;
+    return ms;
+  }
+};
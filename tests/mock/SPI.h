@@ -0,0 +1,23 @@
+#pragma once
+#include "Arduino.h"
+
+#define SPI_CLOCK_DIV2 0
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+struct SPISettings {
+  SPISettings() {}
+  SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass {
+ public:
+  void begin() {}
+  void beginTransaction(SPISettings) {}
+  void endTransaction() {}
+  uint8_t transfer(uint8_t b) {
+    sim::board->spiOut += (char)b;
+    return 0;
+  }
+};
+extern SPIClass SPI;
@@ -0,0 +1,191 @@
+// Simulated board behind the mock Arduino, Ethernet, EEPROM, SPI, Wire and
+// ICMPPing headers. Time only moves when a test moves it, so every run is
+// repeatable. Everything a board owns (pins, W5x00 sockets, EEPROM, heap)
+// lives in a Board; the mocks act on sim::board, and a test running several
+// sketches switches it before calling each one's loop().
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+// W5x00 socket status register values (SnSR)
+enum : uint8_t {
+  SOCK_CLOSED = 0x00, SOCK_INIT = 0x13, SOCK_LISTEN = 0x14, SOCK_SYNSENT = 0x15,
+  SOCK_ESTABLISHED = 0x17, SOCK_FIN_WAIT = 0x18, SOCK_CLOSING = 0x1A, SOCK_TIME_WAIT = 0x1B,
+  SOCK_CLOSE_WAIT = 0x1C, SOCK_LAST_ACK = 0x1D,
+  SOCK_UDP = 0x22, SOCK_IPRAW = 0x32
+};
+
+const uint8_t MAX_SOCKETS = 8;
+const uint16_t EEPROM_MAX = 4096;
+const uint16_t HEAP_SIZE = 1024;
+const uint8_t PINS = 70;
+
+struct Socket {
+  uint8_t status = SOCK_CLOSED;
+  uint16_t port = 0;             // local port
+  uint8_t peerIp[4] = {};
+  uint16_t peerPort = 0;
+  std::string rx;                // received, not yet read by the sketch
+  std::string tx;                // sent by the sketch, not yet taken by the peer
+  uint16_t txSize = 2048;        // TX buffer; tx beyond it waits for the peer
+  bool peerClosed = false;       // the peer sent its FIN
+  unsigned long closeAt = 0;     // FIN_WAIT ends at this time
+  unsigned long writes = 0;      // SEND commands issued
+  unsigned long opens = 0;       // times the socket was opened
+  int peer = -1;                 // the remote end's connection, see connect()
+};
+
+// The remote end of a TCP connection. It outlives the board's use of the
+// socket: once the socket closes or is reopened, what the board sent is
+// kept here for the peer to take.
+struct Connection {
+  int sock;                      // -1 once the board let go of the socket
+  std::string tx;
+};
+
+struct Datagram {
+  uint8_t ip[4];                 // remote address
+  uint16_t port;                 // remote port
+  uint16_t localPort;            // port on the simulated board
+  std::string data;
+};
+
+// A DHT11 reading in tenths; ok == false makes the sensor stay silent
+struct DhtReading {
+  bool ok;
+  int16_t temp;
+  int16_t humidity;
+};
+
+struct HeapStats {
+  size_t used;                   // bytes in live blocks, headers included
+  size_t peak;
+  size_t top;                    // highest address the heap reached (__brkval)
+  size_t largestFree;            // largest block malloc() could still return
+  size_t freeBlocks;             // holes below the top
+  unsigned long allocs;
+  unsigned long failures;
+};
+
+struct Board {
+  Board();
+  ~Board();
+  Board(const Board&) = delete;
+  Board& operator=(const Board&) = delete;
+
+  uint8_t ip[4] = {};
+  uint8_t socketCount = 4;       // MAX_SOCK_NUM: 4 on a W5100, 8 on a W5500
+  Socket sockets[MAX_SOCKETS];
+  std::vector<Connection> connections;     // by the ids connect() returns
+  uint16_t serverPort[MAX_SOCKETS] = {};   // EthernetServer owning each socket
+  unsigned long socketClobbers = 0;        // raw sockets opened over a busy one
+  std::deque<Datagram> udpIn;    // to the board, matched by localPort
+  std::deque<Datagram> udpOut;   // from the board
+  uint8_t pins[PINS] = {};
+  uint8_t pinModes[PINS] = {};
+  unsigned long pinWrites = 0;
+  void (*isr[2])() = {};
+  std::function<DhtReading(unsigned long ms)> dht;   // sensor on pin 2, if any
+  unsigned long dhtReads = 0;
+  std::function<int(const uint8_t* ip)> ping;        // echo round trip in ms, -1 = lost
+  uint8_t* eeprom;               // shared with forked boots, see boot()
+  uint32_t* eepromWrites;        // per cell, for wear
+  unsigned long eepromBusyUntil = 0;   // in micros()
+  long powerFailAfter = -1;      // EEPROM writes left before the power fails
+  unsigned long spiBytes = 0;    // bytes clocked over SPI to the W5x00
+  unsigned long blockedMs = 0;   // time spent inside blocking library calls
+  std::string spiOut;            // SPI.transfer() bytes (shift registers)
+  std::vector<std::string> i2cOut;     // one entry per I2C transmission
+  std::string serial;
+  uint8_t heap[HEAP_SIZE];
+  uint16_t heapTop = 0;
+  std::vector<std::pair<uint16_t, uint16_t>> heapHoles;   // offset, size
+  HeapStats heapUse = {};
+  unsigned long dhtLowAt = 0;    // start signal on pin 2
+  bool dhtDue = false;
+};
+
+extern Board* board;
+extern Board defaultBoard;
+
+// Clock
+extern unsigned long ms;
+extern unsigned long us;         // micros() past ms, for interrupt timing
+void advance(unsigned long dt);  // moves time on, running chip timers and peers
+void block(unsigned long dt);    // as advance(), counted as blocked time
+// Callbacks run every simulated millisecond, between passes or while the
+// sketch waits inside one: stand-in servers and remote hosts
+extern std::vector<std::function<void()>> peers;
+void pass(unsigned long n = 1, unsigned long dt = 1);   // n passes, dt ms apart
+void serviceSensor();            // delivers a pending DHT reply; pass() calls it
+
+// Pins
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+void attachInterrupt(int n, void (*isr)());
+
+// SPI traffic to the W5x00, counted in bytes on the wire: the W5500 frames
+// a burst with 3 bytes of address and control, the W5100 takes 4 bytes per
+// data byte. Each byte takes a microsecond, as at an 8 MHz SPI clock, so a
+// sketch polling the chip sees time pass.
+void spiBurst(size_t data);
+
+// Remote hosts. connect() opens a connection to the board's listening
+// socket on port; outgoing() finds a connection the board is opening.
+// Both return a connection id (-1 if there is none), which the other
+// calls take.
+const uint8_t PEER_IP[4] = { 10, 0, 0, 2 };
+int connect(uint16_t port, const uint8_t* ip = PEER_IP, uint16_t peerPort = 40000);
+int outgoing(uint16_t port);
+void accept(int c);              // answers the board's SYN
+void refuse(int c);
+void send(int c, const std::string& data);
+std::string receive(int c);      // takes what the board sent so far
+void close(int c);               // sends our FIN
+bool closed(int c);              // the board closed its side
+int socketOf(int c);             // the board's socket, -1 once released
+int listening(uint16_t port);    // socket listening on port, -1 if none
+void sendUdp(uint16_t port, const std::string& data, const uint8_t* ip = PEER_IP, uint16_t peerPort = 40000);
+bool receiveUdp(uint16_t port, Datagram& out);   // next datagram sent to port
+extern unsigned long closeDelayMs;   // from our side's FIN to the board's CLOSED
+
+// Socket plumbing used by the Ethernet mocks
+uint8_t readStatus(uint8_t s);
+void openSocket(uint8_t s, uint8_t status, uint16_t port);
+void disconnectSocket(uint8_t s);
+void closeSocket(uint8_t s);
+size_t sendSocket(uint8_t s, const uint8_t* data, size_t n);   // waits for room
+uint16_t txFree(uint8_t s);      // TX buffer space the peer has not yet taken
+int receiveSocket(uint8_t s, uint8_t* data, size_t n);
+
+// EEPROM. Writing a cell takes 3.3 ms; reading or writing while busy
+// blocks. With powerFailAfter set, the board loses power in the middle of
+// the write that many writes later: boot() then returns POWER_FAILED.
+uint8_t eepromRead(uint16_t at);
+void eepromWrite(uint16_t at, uint8_t value);
+bool eepromReady();
+void eepromErase();              // every cell to 0xFF, as shipped
+// Runs body in a child process that shares the board's EEPROM, so every
+// boot starts from the program's initial RAM. Returns what body returned,
+// or POWER_FAILED.
+const int POWER_FAILED = -1;
+int boot(const std::function<int()>& body);
+
+// Heap: a first-fit allocator with avr-libc's 2-byte block headers over the
+// board's heap bytes, for String and friends
+void* heapAlloc(size_t n);
+void* heapRealloc(void* p, size_t n);
+void heapFree(void* p);
+HeapStats heapStats();
+
+// SRAM the sketches paint and measure (stack canary)
+extern uint8_t sram[8192];
+extern uint8_t* stackPointer;
+
+}  // namespace sim
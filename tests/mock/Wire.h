@@ -0,0 +1,27 @@
+#pragma once
+#include "Arduino.h"
+
+// Records each transmission as the address byte followed by the data
+class TwoWire : public Stream {
+ public:
+  void begin() {}
+  void setClock(uint32_t) {}
+  void beginTransmission(uint8_t address) { frame.assign(1, (char)address); }
+  uint8_t endTransmission(bool = true) {
+    sim::board->i2cOut.push_back(frame);
+    return 0;
+  }
+  size_t write(uint8_t b) override {
+    frame += (char)b;
+    return 1;
+  }
+  using Print::write;
+  uint8_t requestFrom(uint8_t, uint8_t) { return 0; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+
+ private:
+  std::string frame;
+};
+extern TwoWire Wire;
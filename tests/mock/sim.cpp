@@ -0,0 +1,529 @@
+#include "Sim.h"
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "Ethernet.h"
+#include "SPI.h"
+#include "Wire.h"
+
+// Tests that link namespaced sketches have no global setup() and loop();
+// they drive each board from a peer callback instead
+__attribute__((weak)) void setup() {}
+__attribute__((weak)) void loop() {}
+
+namespace sim {
+
+static std::vector<Board*>& boards() {
+  static std::vector<Board*> all;
+  return all;
+}
+
+static void* sharedPages(size_t n) {
+  void* p = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) abort();
+  return p;
+}
+
+Board::Board() {
+  eeprom = (uint8_t*)sharedPages(EEPROM_MAX);
+  eepromWrites = (uint32_t*)sharedPages(EEPROM_MAX * sizeof(uint32_t));
+  memset(eeprom, 0xFF, EEPROM_MAX);
+  memset(heap, 0, sizeof(heap));
+  boards().push_back(this);
+}
+
+Board::~Board() {
+  munmap(eeprom, EEPROM_MAX);
+  munmap(eepromWrites, EEPROM_MAX * sizeof(uint32_t));
+  auto& all = boards();
+  all.erase(std::remove(all.begin(), all.end(), this), all.end());
+}
+
+// Built before and destroyed after the sketches' globals, whose Strings live on its heap
+Board defaultBoard __attribute__((init_priority(101)));
+Board* board = &defaultBoard;
+unsigned long ms = 0;
+unsigned long us = 0;
+unsigned long closeDelayMs = 1;
+std::vector<std::function<void()>> peers;
+uint8_t sram[8192];
+uint8_t* stackPointer = sram + sizeof(sram) - 256;
+
+static void detach(Board& b, uint8_t s);
+
+// === Clock ===
+// Time moves a millisecond at a time so sockets close and peers act while
+// the sketch is busy inside a pass as well as between passes
+void advance(unsigned long dt) {
+  static bool inPeers = false;
+  for (unsigned long i = 0; i < dt; i++) {
+    ms++;
+    for (Board* b : boards()) {
+      for (uint8_t s = 0; s < b->socketCount; s++) {
+        Socket& sock = b->sockets[s];
+        if (sock.status == SOCK_FIN_WAIT && (long)(ms - sock.closeAt) >= 0) {
+          sock.status = SOCK_CLOSED;
+          detach(*b, s);
+        }
+      }
+    }
+    if (inPeers) continue;
+    inPeers = true;
+    for (auto& peer : peers) peer();
+    inPeers = false;
+  }
+}
+
+void block(unsigned long dt) {
+  board->blockedMs += dt;
+  advance(dt);
+}
+
+void pass(unsigned long n, unsigned long dt) {
+  for (unsigned long i = 0; i < n; i++) {
+    loop();
+    serviceSensor();
+    advance(dt);
+  }
+}
+
+// === Pins and the DHT11 ===
+void pinMode(uint8_t pin, uint8_t mode) {
+  Board& b = *board;
+  // Releasing the DHT line after the start signal starts the sensor's reply
+  if (pin == 2 && b.pinModes[2] == OUTPUT && !b.pins[2] && mode != OUTPUT && ms - b.dhtLowAt >= 18) {
+    b.dhtDue = true;
+  }
+  if (pin == 2 && mode == OUTPUT) b.dhtLowAt = ms;
+  b.pinModes[pin] = mode;
+  if (mode == INPUT_PULLUP) b.pins[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  Board& b = *board;
+  if (pin == 2 && b.pins[2] && !value) b.dhtLowAt = ms;
+  b.pins[pin] = value;
+  b.pinWrites++;
+}
+
+void attachInterrupt(int n, void (*isr)()) {
+  board->isr[n] = isr;
+}
+
+// The reply is 42 falling edges: the response, the end of the preamble,
+// then one per bit, 78 us after the previous for a 0 and 120 us for a 1
+void serviceSensor() {
+  Board& b = *board;
+  if (!b.dhtDue || !b.isr[0]) return;
+  b.dhtDue = false;
+  if (!b.dht) return;
+  DhtReading r = b.dht(ms);
+  b.dhtReads++;
+  if (!r.ok) return;
+
+  uint16_t h = r.humidity < 0 ? 0 : r.humidity;
+  uint16_t t = r.temp < 0 ? -r.temp : r.temp;
+  uint8_t d[5] = { (uint8_t)(h / 10), (uint8_t)(h % 10), (uint8_t)(t / 10), (uint8_t)(t % 10 | (r.temp < 0 ? 0x80 : 0)), 0 };
+  d[4] = d[0] + d[1] + d[2] + d[3];
+
+  unsigned long start = us;
+  us += 40;
+  b.isr[0]();
+  us += 160;
+  b.isr[0]();
+  for (uint8_t i = 0; i < 40; i++) {
+    us += (d[i / 8] & (0x80 >> (i % 8))) ? 120 : 78;
+    b.isr[0]();
+  }
+  unsigned long took = us - start;
+  us = start;
+  advance((took + 999) / 1000);
+}
+
+// === SPI to the W5x00 ===
+void spiBurst(size_t data) {
+  size_t bytes = board->socketCount == 4 ? 4 * data : 3 + data;
+  board->spiBytes += bytes;
+  us += bytes;
+  if (us >= 1000) {
+    us -= 1000;
+    advance(1);
+  }
+}
+
+// === Sockets ===
+uint8_t readStatus(uint8_t s) {
+  spiBurst(1);
+  return board->sockets[s].status;
+}
+
+void openSocket(uint8_t s, uint8_t status, uint16_t port) {
+  Socket& sock = board->sockets[s];
+  detach(*board, s);
+  sock.status = status;
+  sock.port = port;
+  sock.rx.clear();
+  sock.tx.clear();
+  sock.peerClosed = false;
+  sock.peerPort = 0;
+  memset(sock.peerIp, 0, 4);
+  sock.opens++;
+  spiBurst(1);   // mode
+  spiBurst(2);   // port
+  spiBurst(1);   // OPEN command
+  spiBurst(1);   // status
+}
+
+void disconnectSocket(uint8_t s) {
+  Socket& sock = board->sockets[s];
+  spiBurst(1);
+  if (sock.status == SOCK_ESTABLISHED || sock.status == SOCK_CLOSE_WAIT) {
+    sock.status = SOCK_FIN_WAIT;
+    sock.closeAt = ms + closeDelayMs;
+  } else {
+    sock.status = SOCK_CLOSED;
+    detach(*board, s);
+  }
+}
+
+void closeSocket(uint8_t s) {
+  Socket& sock = board->sockets[s];
+  spiBurst(1);
+  sock.status = SOCK_CLOSED;
+  detach(*board, s);
+  sock.rx.clear();
+}
+
+uint16_t txFree(uint8_t s) {
+  Socket& sock = board->sockets[s];
+  return sock.tx.size() >= sock.txSize ? 0 : sock.txSize - sock.tx.size();
+}
+
+size_t sendSocket(uint8_t s, const uint8_t* data, size_t n) {
+  Socket& sock = board->sockets[s];
+  if (sock.status != SOCK_ESTABLISHED && sock.status != SOCK_CLOSE_WAIT) return 0;
+  spiBurst(2);   // free space, read twice until it agrees
+  spiBurst(2);
+  // The library waits for the peer to make room, or the connection to end;
+  // a minute on, the test's peer is taken to have hung rather than the sketch
+  for (unsigned long waited = 0; n > txFree(s); waited++) {
+    if (sock.status != SOCK_ESTABLISHED && sock.status != SOCK_CLOSE_WAIT) return 0;
+    if (waited == 60000) return 0;
+    block(1);
+  }
+  spiBurst(n);
+  spiBurst(2);   // write pointer
+  spiBurst(1);   // SEND command
+  spiBurst(1);   // command register, polled until clear
+  sock.tx.append((const char*)data, n);
+  sock.writes++;
+  return n;
+}
+
+int receiveSocket(uint8_t s, uint8_t* data, size_t n) {
+  Socket& sock = board->sockets[s];
+  spiBurst(2);   // received size, read twice until it agrees
+  spiBurst(2);
+  size_t k = std::min(n, sock.rx.size());
+  if (!k) return 0;
+  memcpy(data, sock.rx.data(), k);
+  sock.rx.erase(0, k);
+  spiBurst(k);
+  spiBurst(2);   // read pointer
+  spiBurst(1);   // RECV command
+  spiBurst(1);
+  return k;
+}
+
+int listening(uint16_t port) {
+  for (uint8_t s = 0; s < board->socketCount; s++) {
+    if (board->sockets[s].status == SOCK_LISTEN && board->sockets[s].port == port) return s;
+  }
+  return -1;
+}
+
+static int attach(uint8_t s) {
+  Socket& sock = board->sockets[s];
+  if (sock.peer < 0) {
+    sock.peer = board->connections.size();
+    board->connections.push_back(Connection{ s, std::string() });
+  }
+  return sock.peer;
+}
+
+// The board is done with the socket; the peer keeps what it sent
+static void detach(Board& b, uint8_t s) {
+  Socket& sock = b.sockets[s];
+  if (sock.peer < 0) return;
+  Connection& c = b.connections[sock.peer];
+  c.tx += sock.tx;
+  c.sock = -1;
+  sock.tx.clear();
+  sock.peer = -1;
+}
+
+int connect(uint16_t port, const uint8_t* ip, uint16_t peerPort) {
+  int s = listening(port);
+  if (s < 0) return -1;
+  Socket& sock = board->sockets[s];
+  sock.status = SOCK_ESTABLISHED;
+  memcpy(sock.peerIp, ip, 4);
+  sock.peerPort = peerPort;
+  return attach(s);
+}
+
+int outgoing(uint16_t port) {
+  for (uint8_t s = 0; s < board->socketCount; s++) {
+    if (board->sockets[s].status == SOCK_SYNSENT && board->sockets[s].peerPort == port) return attach(s);
+  }
+  return -1;
+}
+
+int socketOf(int c) {
+  return c < 0 || c >= (int)board->connections.size() ? -1 : board->connections[c].sock;
+}
+
+void accept(int c) {
+  int s = socketOf(c);
+  if (s >= 0) board->sockets[s].status = SOCK_ESTABLISHED;
+}
+
+void refuse(int c) {
+  int s = socketOf(c);
+  if (s < 0) return;
+  board->sockets[s].status = SOCK_CLOSED;
+  detach(*board, s);
+}
+
+void send(int c, const std::string& data) {
+  int s = socketOf(c);
+  if (s < 0) return;
+  Socket& sock = board->sockets[s];
+  if (sock.status == SOCK_ESTABLISHED || sock.status == SOCK_FIN_WAIT) sock.rx += data;
+}
+
+std::string receive(int c) {
+  if (c < 0 || c >= (int)board->connections.size()) return "";
+  Connection& conn = board->connections[c];
+  if (conn.sock >= 0) {
+    conn.tx += board->sockets[conn.sock].tx;
+    board->sockets[conn.sock].tx.clear();
+  }
+  std::string out;
+  out.swap(conn.tx);
+  return out;
+}
+
+void close(int c) {
+  int s = socketOf(c);
+  if (s < 0) return;
+  Socket& sock = board->sockets[s];
+  sock.peerClosed = true;
+  if (sock.status == SOCK_ESTABLISHED) {
+    sock.status = SOCK_CLOSE_WAIT;
+  } else if (sock.status == SOCK_FIN_WAIT) {
+    sock.status = SOCK_CLOSED;
+    detach(*board, s);
+  }
+}
+
+bool closed(int c) {
+  int s = socketOf(c);
+  if (s < 0) return true;
+  uint8_t status = board->sockets[s].status;
+  return status != SOCK_ESTABLISHED && status != SOCK_CLOSE_WAIT;
+}
+
+// A datagram for a port with no socket open is dropped by the chip
+void sendUdp(uint16_t port, const std::string& data, const uint8_t* ip, uint16_t peerPort) {
+  for (uint8_t s = 0; s < board->socketCount; s++) {
+    if (board->sockets[s].status == SOCK_UDP && board->sockets[s].port == port) {
+      Datagram d;
+      memcpy(d.ip, ip, 4);
+      d.port = peerPort;
+      d.localPort = port;
+      d.data = data;
+      board->udpIn.push_back(d);
+      return;
+    }
+  }
+}
+
+bool receiveUdp(uint16_t port, Datagram& out) {
+  auto& q = board->udpOut;
+  for (auto it = q.begin(); it != q.end(); ++it) {
+    if (it->port == port) {
+      out = *it;
+      q.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+// === EEPROM ===
+static void eepromWait() {
+  long left = (long)(board->eepromBusyUntil - micros());
+  if (left > 0) block((left + 999) / 1000);
+}
+
+uint8_t eepromRead(uint16_t at) {
+  eepromWait();
+  return board->eeprom[at];
+}
+
+void eepromWrite(uint16_t at, uint8_t value) {
+  Board& b = *board;
+  eepromWait();
+  if (b.powerFailAfter == 0) {
+    // The cell was being erased when the power went: it reads back blank
+    b.eeprom[at] = 0xFF;
+    _exit(111);
+  }
+  if (b.powerFailAfter > 0) b.powerFailAfter--;
+  b.eeprom[at] = value;
+  b.eepromWrites[at]++;
+  b.eepromBusyUntil = micros() + 3300;
+}
+
+bool eepromReady() {
+  return (long)(board->eepromBusyUntil - micros()) <= 0;
+}
+
+void eepromErase() {
+  memset(board->eeprom, 0xFF, EEPROM_MAX);
+  memset(board->eepromWrites, 0, EEPROM_MAX * sizeof(uint32_t));
+}
+
+int boot(const std::function<int()>& body) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) abort();
+  if (pid == 0) {
+    int status = body();
+    fflush(stdout);
+    _exit(status);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status)) return 127;
+  return WEXITSTATUS(status) == 111 ? POWER_FAILED : WEXITSTATUS(status);
+}
+
+// === Heap ===
+// Blocks carry a 2-byte size header, as in avr-libc; freed blocks become
+// holes that later requests are carved from, first fit, and a hole that
+// ends at the top is given back.
+static uint16_t headerSize(uint16_t at) {
+  return board->heap[at] | board->heap[at + 1] << 8;
+}
+
+static void setHeader(uint16_t at, uint16_t size) {
+  board->heap[at] = size & 0xFF;
+  board->heap[at + 1] = size >> 8;
+}
+
+void* heapAlloc(size_t n) {
+  Board& b = *board;
+  if (n < 2) n = 2;
+  b.heapUse.allocs++;
+  auto& holes = b.heapHoles;
+  for (size_t i = 0; i < holes.size(); i++) {
+    uint16_t at = holes[i].first, size = holes[i].second;
+    if (size < n + 2) continue;
+    if (size - (n + 2) >= 4) {
+      holes[i].first += n + 2;
+      holes[i].second -= n + 2;
+      size = n + 2;
+    } else {
+      holes.erase(holes.begin() + i);
+    }
+    setHeader(at, size);
+    b.heapUse.used += size;
+    b.heapUse.peak = std::max(b.heapUse.peak, b.heapUse.used);
+    return b.heap + at + 2;
+  }
+  if (b.heapTop + n + 2 > HEAP_SIZE) {
+    b.heapUse.failures++;
+    return nullptr;
+  }
+  uint16_t at = b.heapTop;
+  b.heapTop += n + 2;
+  setHeader(at, n + 2);
+  b.heapUse.used += n + 2;
+  b.heapUse.peak = std::max(b.heapUse.peak, b.heapUse.used);
+  b.heapUse.top = std::max<size_t>(b.heapUse.top, b.heapTop);
+  return b.heap + at + 2;
+}
+
+void heapFree(void* p) {
+  if (!p) return;
+  Board& b = *board;
+  uint16_t at = (uint8_t*)p - b.heap - 2;
+  uint16_t size = headerSize(at);
+  b.heapUse.used -= size;
+  auto& holes = b.heapHoles;
+  holes.push_back({ at, size });
+  std::sort(holes.begin(), holes.end());
+  // Merge neighbours, then return a hole at the top
+  for (size_t i = 0; i + 1 < holes.size();) {
+    if (holes[i].first + holes[i].second == holes[i + 1].first) {
+      holes[i].second += holes[i + 1].second;
+      holes.erase(holes.begin() + i + 1);
+    } else {
+      i++;
+    }
+  }
+  if (!holes.empty() && holes.back().first + holes.back().second == b.heapTop) {
+    b.heapTop = holes.back().first;
+    holes.pop_back();
+  }
+}
+
+void* heapRealloc(void* p, size_t n) {
+  if (!p) return heapAlloc(n);
+  Board& b = *board;
+  uint16_t at = (uint8_t*)p - b.heap - 2;
+  uint16_t size = headerSize(at);
+  if (n + 2 <= size) return p;
+  // The top block grows in place
+  if (at + size == b.heapTop && at + n + 2 <= HEAP_SIZE) {
+    b.heapTop = at + n + 2;
+    b.heapUse.used += n + 2 - size;
+    b.heapUse.peak = std::max(b.heapUse.peak, b.heapUse.used);
+    b.heapUse.top = std::max<size_t>(b.heapUse.top, b.heapTop);
+    setHeader(at, n + 2);
+    return p;
+  }
+  void* q = heapAlloc(n);
+  if (!q) return nullptr;
+  memcpy(q, p, size - 2);
+  heapFree(p);
+  return q;
+}
+
+HeapStats heapStats() {
+  Board& b = *board;
+  HeapStats st = b.heapUse;
+  st.freeBlocks = b.heapHoles.size();
+  st.largestFree = HEAP_SIZE - b.heapTop;
+  for (auto& h : b.heapHoles) st.largestFree = std::max<size_t>(st.largestFree, h.second - 2);
+  return st;
+}
+
+}  // namespace sim
+
+// === Core objects ===
+volatile uint8_t PORTB, PORTD, PORTE, PORTG, PORTH, DDRB, DDRD, PINB, PIND, SREG;
+FlagRegister EIFR;
+void* __brkval = sim::sram;
+uint8_t __heap_start;
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+SPIClass SPI;
+TwoWire Wire;
+EthernetClass::ServerPorts EthernetClass::_server_port;
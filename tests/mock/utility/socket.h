@@ -0,0 +1,32 @@
+// Socket API of the Ethernet libraries, driving the simulated chip
+#pragma once
+#include "../Arduino.h"
+
+#ifndef MAX_SOCK_NUM
+#define MAX_SOCK_NUM 4
+#endif
+typedef uint8_t SOCKET;
+
+inline uint8_t socket(SOCKET s, uint8_t protocol, uint16_t port, uint8_t) {
+  sim::closeSocket(s);
+  sim::openSocket(s, protocol == 0x03 ? sim::SOCK_IPRAW : protocol == 0x02 ? sim::SOCK_UDP : sim::SOCK_INIT, port);
+  sim::board->serverPort[s] = 0;
+  return 1;
+}
+
+inline uint8_t connect(SOCKET s, uint8_t* addr, uint16_t port) {
+  sim::Socket& sock = sim::board->sockets[s];
+  if (sock.status != sim::SOCK_INIT || !port || !addr[0]) return 0;
+  memcpy(sock.peerIp, addr, 4);
+  sock.peerPort = port;
+  sock.status = sim::SOCK_SYNSENT;
+  sim::spiBurst(4);
+  sim::spiBurst(2);
+  sim::spiBurst(1);
+  return 1;
+}
+
+inline void disconnect(SOCKET s) { sim::disconnectSocket(s); }
+inline void close(SOCKET s) { sim::closeSocket(s); }
+inline uint16_t send(SOCKET s, const uint8_t* buf, uint16_t len) { return sim::sendSocket(s, buf, len); }
+inline int16_t recv(SOCKET s, uint8_t* buf, int16_t len) { return sim::receiveSocket(s, buf, len); }
@@ -0,0 +1,35 @@
+#pragma once
+#include "socket.h"
+
+class SnSR {
+ public:
+  static const uint8_t CLOSED = sim::SOCK_CLOSED;
+  static const uint8_t INIT = sim::SOCK_INIT;
+  static const uint8_t LISTEN = sim::SOCK_LISTEN;
+  static const uint8_t SYNSENT = sim::SOCK_SYNSENT;
+  static const uint8_t ESTABLISHED = sim::SOCK_ESTABLISHED;
+  static const uint8_t FIN_WAIT = sim::SOCK_FIN_WAIT;
+  static const uint8_t CLOSING = sim::SOCK_CLOSING;
+  static const uint8_t TIME_WAIT = sim::SOCK_TIME_WAIT;
+  static const uint8_t CLOSE_WAIT = sim::SOCK_CLOSE_WAIT;
+  static const uint8_t LAST_ACK = sim::SOCK_LAST_ACK;
+  static const uint8_t UDP = sim::SOCK_UDP;
+  static const uint8_t IPRAW = sim::SOCK_IPRAW;
+};
+
+class SnMR {
+ public:
+  static const uint8_t TCP = 0x01;
+  static const uint8_t UDP = 0x02;
+  static const uint8_t IPRAW = 0x03;
+};
+
+struct W5100Class {
+  uint8_t readSnSR(SOCKET s) { return sim::readStatus(s); }
+  uint16_t getTXFreeSize(SOCKET s) {
+    sim::spiBurst(2);
+    sim::spiBurst(2);
+    return sim::txFree(s);
+  }
+};
+static W5100Class W5100 __attribute__((unused));
@@ -0,0 +1,4 @@
+#pragma once
+#include "w5100.h"
+
+static W5100Class w5500 __attribute__((unused));
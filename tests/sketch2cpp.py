@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Turns a sketch into a C++ file for the host build, as the Arduino IDE
+does before compiling: Arduino.h is included and a prototype of every
+function is inserted ahead of the first function definition.
+
+    sketch2cpp.py SKETCH OUT [--namespace NAME]...
+
+With --namespace the sketch is wrapped in namespace NAME, its #includes
+hoisted above it, once per name given, so a test can link several boards
+running the same sketch into one program.
+"""
+import argparse
+import re
+
+FUNCTION = re.compile(r'^([A-Za-z_][\w:<>,\s\*&]*?[\s\*&])([A-Za-z_]\w*)\s*\(([^;{]*)\)\s*(const\s*)?\{', re.M)
+NOT_FUNCTIONS = ('if', 'for', 'while', 'switch', 'return', 'sizeof')
+# Symbols the mock core declares itself; a namespaced redeclaration would hide them
+CORE_EXTERNS = re.compile(r'^extern\s+(uint8_t\s+__heap_start|void\s*\*\s*__brkval)\s*;\s*$', re.M)
+
+
+def prototypes(src):
+    out = []
+    for m in FUNCTION.finditer(src):
+        ret, name, args = m.group(1).strip(), m.group(2), m.group(3)
+        if name in NOT_FUNCTIONS or ret.split()[-1] in ('else', 'return', 'new'):
+            continue
+        before = src[:m.start()].rstrip().splitlines()
+        if ret.startswith('template') or (before and before[-1].strip().startswith('template')):
+            continue
+        if '::' in name or '::' in ret.split()[-1]:
+            continue
+        args = re.sub(r'\s*=[^,]*', '', args)
+        out.append('%s %s(%s);' % (ret, name, ' '.join(args.split())))
+    return out
+
+
+def convert(src, path, namespaces=None):
+    first = next(FUNCTION.finditer(src)).start()
+    head, body = src[:first], src[first:]
+    line = head.count('\n') + 1
+    protos = '\n'.join(prototypes(src))
+    if not namespaces:
+        return ('#include <Arduino.h>\n#line 1 "%s"\n%s%s\n#line %d "%s"\n%s'
+                % (path, head, protos, line, path, body))
+
+    includes = [l for l in src.splitlines() if l.startswith('#include')]
+    head = '\n'.join('' if l.startswith('#include') else l for l in head.split('\n'))
+    head = CORE_EXTERNS.sub('', head)
+    out = '#include <Arduino.h>\n%s\n' % '\n'.join(includes)
+    for ns in namespaces:
+        out += ('namespace %s {\n#line 1 "%s"\n%s%s\n#line %d "%s"\n%s\n}  // namespace %s\n'
+                % (ns, path, head, protos, line, path, body, ns))
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('sketch')
+    ap.add_argument('out')
+    ap.add_argument('--namespace', action='append')
+    args = ap.parse_args()
+    with open(args.sketch, newline='') as f:
+        src = f.read().replace('\r\n', '\n')
+    with open(args.out, 'w') as f:
+        f.write(convert(src, args.sketch, args.namespace))
+
+
+if __name__ == '__main__':
+    main()
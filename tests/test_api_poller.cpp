@@ -0,0 +1,190 @@
+// sketch: main.cpp
+// The api mode poller (user-014) against a local stand-in HTTP server: the
+// relay follows the endpoint's answer every poll interval, keeps its last
+// decision while a fetch is out, backs off on every kind of failure, and
+// never holds up the web server.
+#include "main.cpp"
+#include "harness.h"
+
+#include <set>
+
+// Serves the board's outgoing connections to port 8080
+struct ApiServer {
+  enum Mode { ANSWER, NO_SYN, REFUSE, SILENT, DRIP, ERROR_500, GARBAGE };
+  Mode mode = ANSWER;
+  std::string answer = "on";
+  unsigned long latencyMs = 20;
+  std::vector<unsigned long> synAt;      // when each connection was opened
+  std::vector<std::string> requestLines;
+
+  void step() {
+    int c = sim::outgoing(8080);
+    if (c >= 0 && seen.insert(c).second) {
+      synAt.push_back(sim::ms);
+      if (mode == REFUSE) sim::refuse(c);
+      else if (mode != NO_SYN) {
+        sim::accept(c);
+        conns.push_back(Conn());
+        conns.back().id = c;
+      }
+    }
+    for (Conn& conn : conns) serve(conn);
+  }
+
+ private:
+  struct Conn {
+    int id;
+    std::string request;
+    unsigned long requestAt = 0;
+    std::string reply;
+    bool done = false;
+  };
+  std::set<int> seen;
+  std::vector<Conn> conns;
+
+  void serve(Conn& conn) {
+    if (conn.done) return;
+    if (sim::socketOf(conn.id) < 0) {
+      conn.done = true;
+      return;
+    }
+    if (!conn.requestAt) {
+      conn.request += sim::receive(conn.id);
+      size_t end = conn.request.find("\r\n\r\n");
+      if (end == std::string::npos) return;
+      requestLines.push_back(conn.request.substr(0, conn.request.find("\r\n")));
+      conn.requestAt = sim::ms;
+      conn.reply = mode == ERROR_500 ? "HTTP/1.0 500 Internal Server Error\r\n\r\non"
+                   : "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n" + (mode == GARBAGE ? "maybe" : answer);
+    }
+    if (mode == SILENT || sim::ms - conn.requestAt < latencyMs) return;
+    if (mode == DRIP) {
+      sim::send(conn.id, conn.reply.substr(0, 1));
+      conn.reply.erase(0, 1);
+      latencyMs += 10;   // a byte every 10 ms
+    } else {
+      sim::send(conn.id, conn.reply);
+      conn.reply.clear();
+    }
+    if (conn.reply.empty()) {
+      sim::close(conn.id);
+      conn.done = true;
+    }
+  }
+};
+
+static ApiServer endpoint;
+static const uint8_t RELAY = 1;
+
+static void runFor(unsigned long ms) {
+  unsigned long start = sim::ms;
+  while (sim::ms - start < ms) sim::pass(1);
+}
+
+static void pollEvery(uint16_t seconds) {
+  RelaySettings& relay = relaySettings[RELAY];
+  relay.mode = MODE_API;
+  strcpy(relay.apiEndpoint, "http://10.0.0.9:8080/relay?id=2");
+  relay.apiPollSeconds = seconds;
+  apiRestart(RELAY);
+}
+
+// The relay follows the answer, one fetch per interval
+static void testFollows() {
+  endpoint.mode = ApiServer::ANSWER;
+  endpoint.answer = "on";
+  pollEvery(5);
+  runFor(100);
+  CHECK(relayState(RELAY));
+  CHECK(!endpoint.requestLines.empty() && endpoint.requestLines.back() == "GET /relay?id=2 HTTP/1.0");
+
+  endpoint.answer = "0";
+  runFor(4800);
+  CHECK(relayState(RELAY));
+  runFor(300);
+  CHECK(!relayState(RELAY));
+
+  size_t fetches = endpoint.synAt.size();
+  runFor(60000);
+  CHECK(endpoint.synAt.size() - fetches >= 11 && endpoint.synAt.size() - fetches <= 12);   // 5 s plus the fetch
+  CHECK_EQ(api.relays[RELAY].errors, 0);
+}
+
+// A slow answer: the relay keeps the cached decision until it arrives
+static void testCachedWhileFetching() {
+  endpoint.answer = "true";
+  endpoint.latencyMs = 1500;
+  apiRestart(RELAY);
+  runFor(700);
+  CHECK(api.state == API_READING);
+  CHECK(!relayState(RELAY));
+  runFor(1000);
+  CHECK(api.state == API_IDLE);
+  CHECK(relayState(RELAY));
+  endpoint.latencyMs = 20;
+}
+
+// Each failure leaves the relay alone and doubles the wait after it
+static void testBackoff() {
+  const ApiServer::Mode failures[] = { ApiServer::NO_SYN, ApiServer::REFUSE, ApiServer::SILENT,
+                                       ApiServer::ERROR_500, ApiServer::GARBAGE };
+  for (ApiServer::Mode mode : failures) {
+    endpoint.mode = mode;
+    apiRestart(RELAY);
+    size_t first = endpoint.synAt.size();
+    unsigned long errors = api.relays[RELAY].errors;
+    runFor(200000);
+    CHECK(relayState(RELAY));
+    // Fetches at 0, then 5, 10, 20, 40 and 80 s after each failure ends
+    CHECK_EQ(endpoint.synAt.size() - first, 6);
+    CHECK_EQ(api.relays[RELAY].errors - errors, 6);
+    for (size_t i = first + 1; i + 1 < endpoint.synAt.size(); i++) {
+      unsigned long gap = endpoint.synAt[i + 1] - endpoint.synAt[i];
+      unsigned long wait = 5000UL << (i - first);
+      unsigned long took = mode == ApiServer::NO_SYN ? API_CONNECT_TIMEOUT_MS
+                           : mode == ApiServer::SILENT ? API_READ_TIMEOUT_MS : 0;
+      CHECK(gap >= wait + took && gap <= wait + took + 50);
+    }
+  }
+  printf("backoff after failures: 5, 10, 20, 40, 80 s, relay kept\n");
+
+  // Back to normal: the next fetch resets the backoff
+  endpoint.mode = ApiServer::ANSWER;
+  endpoint.answer = "off";
+  runFor(170000);
+  CHECK(!relayState(RELAY));
+  CHECK_EQ(api.relays[RELAY].failures, 0);
+}
+
+// Web requests are served as quickly with the endpoint hanging or trickling
+// its answer as with no api relay at all
+static void testWebUnaffected() {
+  std::vector<std::string> reqs = { "GET /api/state HTTP/1.1\r\nHost: board\r\n" + sessionCookie() + "\r\n" };
+  relaySettings[RELAY].mode = MODE_BASIC;
+  LoadReport base = HttpLoad(reqs, 2, true).run(100);
+  const ApiServer::Mode modes[] = { ApiServer::NO_SYN, ApiServer::SILENT, ApiServer::DRIP };
+  const char* names[] = { "no SYN-ACK", "silent", "trickling" };
+  for (int i = 0; i < 3; i++) {
+    endpoint.mode = modes[i];
+    pollEvery(5);
+    size_t synced = endpoint.synAt.size();
+    LoadReport r = HttpLoad(reqs, 2, true).run(2000);
+    CHECK(endpoint.synAt.size() > synced);
+    printf("web with the endpoint %-10s: max %lu ms (%lu ms without), %lu failed, %lu ms blocked\n", names[i],
+           r.latency(1.0), base.latency(1.0), r.failures, r.blockedMs);
+    CHECK_EQ(r.failures, 0);
+    CHECK_EQ(r.blockedMs, 0);
+    CHECK(r.latency(1.0) <= base.latency(1.0) + 5);
+  }
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  sim::peers.push_back([] { endpoint.step(); });
+  testFollows();
+  testCachedWhileFetching();
+  testBackoff();
+  testWebUnaffected();
+  return testResult("test_api_poller");
+}
@@ -0,0 +1,161 @@
+// sketch: main.cpp
+// The EEPROM config log (user-009): settings survive a reboot, and losing
+// power at any point of a save leaves either the old or the new value of
+// the section being saved, with every other section intact. Saving one
+// section over and over wears the whole EEPROM evenly, and a section
+// changed while its record is being written is never stored half old,
+// half new.
+#include "main.cpp"
+#include "harness.h"
+
+// Exit codes of a boot's checks
+enum { BOOT_OLD = 0, BOOT_NEW = 1, BOOT_LOST = 2, BOOT_UNSAVED = 3 };
+
+static bool configIdle() {
+  for (uint8_t i = 0; i < sizeof(configStore.dirty); i++) {
+    if (configStore.dirty[i]) return false;
+  }
+  return !configStore.writing;
+}
+
+static bool runUntilSaved() {
+  for (int i = 0; i < 100000 && !configIdle(); i++) sim::pass(1);
+  return configIdle();
+}
+
+// The values every section but relay 1 is set to, as a fingerprint
+static void markSections() {
+  for (uint8_t i = 1; i < RELAY_COUNT; i++) {
+    relaySettings[i].tempMax = 400 + i;
+    configSave((ConfigSectionId)(CFG_RELAY1 + i));
+  }
+  strcpy(snmpSettings.readCommunity, "marked");
+  configSave(CFG_SNMP);
+  strcpy(mqttSettings.prefix, "marked");
+  configSave(CFG_MQTT);
+}
+
+static bool sectionsMarked() {
+  for (uint8_t i = 1; i < RELAY_COUNT; i++) {
+    if (relaySettings[i].tempMax != 400 + i) return false;
+  }
+  return strcmp(snmpSettings.readCommunity, "marked") == 0 && strcmp(mqttSettings.prefix, "marked") == 0;
+}
+
+// Boots, checks relay 1's tempMax is old or new, then sets it to next with
+// the power failing after failAfter EEPROM writes (-1: never)
+static int bootAndSave(int16_t old, int16_t now, int16_t next, long failAfter) {
+  return sim::boot([=] {
+    setup();
+    if (!runUntilSaved()) return (int)BOOT_UNSAVED;
+    int result = relaySettings[0].tempMax == now ? BOOT_NEW : relaySettings[0].tempMax == old ? BOOT_OLD : BOOT_LOST;
+    if (!sectionsMarked()) result = BOOT_LOST;
+    sim::board->powerFailAfter = failAfter;
+    relaySettings[0].tempMax = next;
+    configSave(CFG_RELAY1);
+    if (!runUntilSaved()) return (int)BOOT_UNSAVED;
+    return result;
+  });
+}
+
+static void testRestore() {
+  sim::eepromErase();
+  CHECK_EQ(sim::boot([] {
+    setup();
+    markSections();
+    relaySettings[0].tempMax = 111;
+    configSave(CFG_RELAY1);
+    return runUntilSaved() ? 0 : 1;
+  }), 0);
+  CHECK_EQ(bootAndSave(0, 111, 111, -1), BOOT_NEW);
+}
+
+// Cuts the power at every write of a save in turn: each boot after finds
+// either the value from before the save or the one being saved
+static void testPowerLoss() {
+  int16_t value = 111;
+  int cuts = 0;
+  for (long k = 0; k < 200; k++) {
+    int16_t next = 1000 + k;
+    int r = bootAndSave(value, value, next, k);
+    if (r != sim::POWER_FAILED) {
+      CHECK_EQ(r, BOOT_NEW);
+      break;   // the save needed fewer than k writes
+    }
+    cuts++;
+    r = bootAndSave(value, next, next, -1);
+    CHECK(r == BOOT_OLD || r == BOOT_NEW);
+    // Start the next round from whatever the board now holds
+    value = next;
+    CHECK_EQ(bootAndSave(value, value, value, -1), BOOT_NEW);
+  }
+  CHECK(cuts >= 4);
+  printf("power cut at each of %d writes of a save: no section lost\n", cuts);
+}
+
+// Relay 1's tempMin and tempMax are changed together after tempMin's bytes
+// are written but before tempMax's; the record being written when the power
+// fails holds both new values
+static void testChangeMidRecord() {
+  CHECK_EQ(sim::boot([] {
+    setup();
+    relaySettings[0].tempMin = 11;
+    relaySettings[0].tempMax = 12;
+    configSave(CFG_RELAY1);
+    const uint8_t at = CONFIG_HEADER_SIZE + offsetof(RelaySettings, tempMax);
+    for (int i = 0; i < 100000; i++) {
+      if (configStore.writing && configStore.section == CFG_RELAY1 && configStore.pos == at) break;
+      sim::pass(1);
+    }
+    if (configStore.pos != at) return 1;
+    relaySettings[0].tempMin = 21;
+    relaySettings[0].tempMax = 22;
+    configSave(CFG_RELAY1);
+    // The power fails as soon as the record being written is finished
+    for (int i = 0; i < 100000 && configStore.writing; i++) sim::pass(1);
+    return configStore.writing ? 1 : 0;
+  }), 0);
+  CHECK_EQ(sim::boot([] {
+    setup();
+    return relaySettings[0].tempMin == 21 && relaySettings[0].tempMax == 22 ? 0 : 1;
+  }), 0);
+}
+
+// The clock section, one slot of 128, saved 3000 times: every slot takes
+// its share, including the moves of the sections in the head's way
+static void testWear() {
+  sim::eepromErase();
+  memset(sim::board->eepromWrites, 0, (E2END + 1) * sizeof(uint32_t));
+  const int saves = 3000;
+  CHECK_EQ(sim::boot([] {
+    setup();
+    markSections();
+    for (int i = 0; i < saves; i++) {
+      clockSettings.driftPpm = i;
+      configSave(CFG_CLOCK);
+      if (!runUntilSaved()) return 1;
+    }
+    return 0;
+  }), 0);
+  uint32_t most = 0, least = 0xFFFFFFFF;
+  for (int slot = 0; slot < CONFIG_SLOTS; slot++) {
+    const uint32_t* cells = sim::board->eepromWrites + slot * CONFIG_SLOT_SIZE;
+    least = std::min(least, cells[0]);   // a slot's first cell, written by any record there
+    for (int i = 0; i < CONFIG_SLOT_SIZE; i++) most = std::max(most, cells[i]);
+  }
+  printf("%d saves of one section: most written cell %u times, least written slot %u\n", saves, most, least);
+  CHECK(most <= saves / 20);
+  CHECK(least > 0);
+  CHECK_EQ(sim::boot([] {
+    setup();
+    return clockSettings.driftPpm == saves - 1 && sectionsMarked() ? 0 : 1;
+  }), 0);
+}
+
+int main() {
+  testRestore();
+  testPowerLoss();
+  testChangeMidRecord();
+  testWear();
+  return testResult("test_config");
+}
@@ -0,0 +1,200 @@
+// sketch: main.cpp
+// Per-socket connection state machines (user-006): a client that is slow to
+// send or slow to read holds up nobody else, clients beyond the connection
+// slots wait their turn, and a closed socket reopened for a new client is
+// not torn down by the connection that closed it. A malformed request gets
+// a 400 whatever its session.
+#include "main.cpp"
+#include "harness.h"
+
+static std::string auth;
+
+static std::string get(const std::string& path, bool close = false) {
+  return "GET " + path + " HTTP/1.1\r\nHost: board\r\n" + (close ? "Connection: close\r\n" : "") + auth + "\r\n";
+}
+
+// Runs passes until the response on s is complete; its latency in ms, or -1
+static long await(int s, std::string& buf, HttpResponse& r, unsigned long maxMs = 1000) {
+  unsigned long start = sim::ms;
+  while (sim::ms - start < maxMs) {
+    sim::pass(1);
+    buf += sim::receive(s);
+    if (takeResponse(buf, sim::closed(s), r)) return sim::ms - start;
+  }
+  return -1;
+}
+
+static void testSlowSender() {
+  int slow = sim::connect(80);
+  sim::send(slow, "GET /api/state HTTP/1.1\r\nHo");
+  sim::pass(20);
+
+  int fast = sim::connect(80);
+  CHECK(fast >= 0 && fast != slow);
+  sim::send(fast, get("/api/state", true));
+  std::string buf;
+  HttpResponse r;
+  long ms = await(fast, buf, r);
+  CHECK(ms >= 0 && ms < 50);
+  CHECK_EQ(r.status, 200);
+
+  sim::send(slow, "st: board\r\nConnection: close\r\n" + auth + "\r\n");
+  buf.clear();
+  CHECK(await(slow, buf, r) >= 0);
+  CHECK_EQ(r.status, 200);
+  sim::pass(10);
+}
+
+// A page bigger than a reader's TX buffer is sent as the reader takes it,
+// while another client is served in between
+static void testSlowReader() {
+  int slow = sim::connect(80);
+  sim::Socket& sock = sim::board->sockets[sim::socketOf(slow)];
+  sock.txSize = 256;
+  sim::send(slow, get("/", true));
+  sim::pass(20);
+  CHECK(sock.tx.size() <= 256);
+
+  int fast = sim::connect(80);
+  sim::send(fast, get("/api/state", true));
+  std::string buf;
+  HttpResponse r;
+  long ms = await(fast, buf, r);
+  CHECK(ms >= 0 && ms < 50);
+  CHECK_EQ(r.status, 200);
+
+  buf.clear();
+  unsigned long start = sim::ms;
+  while (!takeResponse(buf, sim::closed(slow), r) && sim::ms - start < 2000) {
+    buf += sim::receive(slow);
+    sim::pass(1);
+  }
+  CHECK(r.complete);
+  CHECK_EQ(r.status, 200);
+  CHECK(r.body.size() > 1024);
+  CHECK(r.body.find("</html>") != std::string::npos);
+  sock.txSize = 2048;
+  sim::pass(10);
+}
+
+// A page changing while a slow reader takes it: a change in the part not
+// yet sent goes out with it, while a change in the part already sent ends
+// the response short, so no page is spliced from two renderings
+static void testChangedWhileSent() {
+  sensor.valid = true;
+  sensor.temp = 215;
+  mqtt.publishes = 1;
+  for (int sentChanged = 0; sentChanged < 2; sentChanged++) {
+    int slow = sim::connect(80);
+    sim::Socket& sock = sim::board->sockets[sim::socketOf(slow)];
+    sock.txSize = 512;
+    sim::send(slow, get("/", true));
+    std::string buf;
+    for (int t = 0; t < 100 && buf.find("21.5") == std::string::npos; t++) {
+      sim::pass(1);
+      buf += sim::receive(slow);
+    }
+    CHECK(buf.find("21.5") != std::string::npos);
+    CHECK(buf.find("Published:") == std::string::npos);
+    unsigned long aborted = metrics.aborted;
+    if (sentChanged) sensor.temp = 216;
+    else mqtt.publishes = 2;
+
+    HttpResponse r;
+    unsigned long start = sim::ms;
+    while (!takeResponse(buf, sim::closed(slow), r) && sim::ms - start < 2000) {
+      buf += sim::receive(slow);
+      sim::pass(1);
+    }
+    CHECK(buf.find("21.6") == std::string::npos);
+    if (sentChanged) {
+      CHECK(!r.complete);
+      CHECK(sim::closed(slow));
+      CHECK_EQ(metrics.aborted, aborted + 1);
+    } else {
+      CHECK(r.complete);
+      CHECK(r.body.find("Published: 2") != std::string::npos);
+      CHECK_EQ(metrics.aborted, aborted);
+    }
+    sock.txSize = 2048;
+    sim::pass(10);
+  }
+}
+
+// More clients than connection slots: the rest wait with their requests
+// queued on the chip and are served as slots free up
+static void testMoreClientsThanSlots() {
+  const int n = HTTP_MAX_CONNECTIONS + 2;
+  int conns[n];
+  std::string bufs[n];
+  HttpResponse rs[n];
+  int opened = 0;
+  for (int i = 0; i < n; i++) {
+    conns[i] = sim::connect(80);
+    if (conns[i] < 0) {
+      sim::pass(1);
+      conns[i] = sim::connect(80);
+    }
+    if (conns[i] < 0) break;
+    sim::send(conns[i], get("/api/state", true));
+    opened++;
+    sim::pass(1);
+  }
+  CHECK(opened > HTTP_MAX_CONNECTIONS);
+  for (unsigned long t = 0; t < 500; t++) {
+    sim::pass(1);
+    for (int i = 0; i < opened; i++) {
+      if (rs[i].complete) continue;
+      bufs[i] += sim::receive(conns[i]);
+      takeResponse(bufs[i], sim::closed(conns[i]), rs[i]);
+    }
+  }
+  for (int i = 0; i < opened; i++) CHECK_EQ(rs[i].status, 200);
+  sim::pass(10);
+}
+
+// Connections closing while server.available() reopens their sockets for
+// new clients: every request is answered
+static void testSocketReuse() {
+  std::vector<std::string> reqs = { get("/api/state"), get("/relay1/on"), get("/relay1/off") };
+  LoadReport r = HttpLoad(reqs, 3, false).run(300);
+  printf("3 clients, close:      p50 %lu ms, max %lu ms, %lu failed\n", r.latency(0.5), r.latency(1.0), r.failures);
+  CHECK_EQ(r.failures, 0);
+  CHECK_EQ(r.requests, 300);
+  CHECK(r.latency(1.0) < 100);
+  LoadReport k = HttpLoad(reqs, 3, true).run(300);
+  printf("3 clients, keep-alive: p50 %lu ms, max %lu ms, %lu failed, %lu retried\n", k.latency(0.5), k.latency(1.0),
+         k.failures, k.retries);
+  CHECK_EQ(k.failures, 0);
+  CHECK(k.latency(1.0) < 100);
+}
+
+// A request the parser flags bad is answered 400 and the connection
+// closed, even with a valid session, rather than routed or shown the page
+static void testBadRequest() {
+  const std::string bad[] = { get("/relay1/on?" + std::string(200, 'a') + "=1"), get("/relay1000/on"),
+                              "GET relay1/on HTTP/1.1\r\nHost: board\r\n" + auth + "\r\n" };
+  for (const std::string& request : bad) {
+    bool was = relayState(0);
+    HttpResponse r = httpRequest(request);
+    CHECK_EQ(r.status, 400);
+    CHECK(r.body.empty());
+    CHECK(r.closed);
+    CHECK_EQ(relayState(0), was);
+  }
+  CHECK_EQ(httpRequest(get("/api/state")).status, 200);
+}
+
+int main() {
+  setup();
+  sim::pass(100);
+  auth = sessionCookie();
+  CHECK(!auth.empty());
+  testSlowSender();
+  testSlowReader();
+  testChangedWhileSent();
+  testMoreClientsThanSlots();
+  testSocketReuse();
+  testBadRequest();
+  return testResult("test_connections");
+}
@@ -0,0 +1,75 @@
+// sketch: main.cpp
+// Fleet commands (user-024) as a node sees them: a command is applied and
+// acknowledged only when it comes from the configured master, so another
+// host on the LAN cannot switch the relays with one broadcast.
+#include "main.cpp"
+#include "harness.h"
+
+static const uint8_t MASTER_IP[4] = { 10, 0, 0, 7 };
+
+static std::string command(uint16_t id, uint8_t groups, uint8_t mask, uint8_t select) {
+  const uint8_t f[FLEET_COMMAND_SIZE] = {
+    FLEET_MAGIC, FLEET_VERSION, FLEET_COMMAND, (uint8_t)id, (uint8_t)(id >> 8), groups, mask, 0, 0, 0, select
+  };
+  return std::string((const char*)f, sizeof(f));
+}
+
+// Takes the acks the board sent, dropping its announces
+static int acks() {
+  int n = 0;
+  sim::Datagram d;
+  while (sim::receiveUdp(FLEET_PORT, d)) {
+    if (d.data.size() == FLEET_ACK_SIZE && (uint8_t)d.data[2] == FLEET_ACK) n++;
+  }
+  return n;
+}
+
+// Until a master address is set, and from any other address, a command
+// changes nothing, is not answered and counts as bad
+static void testForeignCommands() {
+  setRelayState(0, false);
+  acks();
+  sim::sendUdp(FLEET_PORT, command(1, 0, 0x01, 0x01));
+  sim::pass(10);
+  CHECK(!relayState(0));
+  CHECK_EQ(acks(), 0);
+  CHECK_EQ(fleet.bad, 1UL);
+
+  memcpy(network.fleet.master, MASTER_IP, 4);
+  sim::sendUdp(FLEET_PORT, command(2, 0, 0x01, 0x01));
+  sim::pass(10);
+  CHECK(!relayState(0));
+  CHECK_EQ(acks(), 0);
+  CHECK_EQ(fleet.bad, 2UL);
+}
+
+static void testMasterCommands() {
+  memcpy(network.fleet.master, MASTER_IP, 4);
+  sim::sendUdp(FLEET_PORT, command(3, 0, 0x01, 0x01), MASTER_IP, FLEET_PORT);
+  sim::pass(10);
+  CHECK(relayState(0));
+  CHECK_EQ(acks(), 1);
+}
+
+// The master address is set with the other fleet settings and kept
+static void testSetMaster() {
+  std::string cookie = sessionCookie();
+  httpGet("/setfleet?role=node&master=10.0.0.9", cookie);
+  CHECK_EQ(network.fleet.role, FLEET_NODE);
+  CHECK(IPAddress(network.fleet.master) == IPAddress(10, 0, 0, 9));
+  HttpResponse r = httpGet("/api/fleet", cookie);
+  CHECK_EQ(r.status, 200);
+  CHECK(r.body.find("\"master\":\"10.0.0.9\"") != std::string::npos);
+}
+
+int main() {
+  setup();
+  relaySettings[0].mode = MODE_BASIC;
+  network.fleet.role = FLEET_NODE;
+  fleetBegin();
+  sim::pass(10);
+  testForeignCommands();
+  testMasterCommands();
+  testSetMaster();
+  return testResult("test_fleet");
+}
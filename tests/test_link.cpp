@@ -0,0 +1,340 @@
+// sketch: two-ns.cpp
+// The board link (user-023) between two simulated boards over a network
+// that loses, delays, reorders, duplicates and corrupts frames: relay state
+// and commands still arrive, each command is carried out once, mirror and
+// standby modes follow the peer, a silent peer is taken over within
+// LINK_TIMEOUT_MS, a restarted link gets the full state again, and browsers
+// cannot take the socket the ping watchdog needs.
+#include "two-ns.cpp"
+#include "harness.h"
+
+// What a test reads of a board's link
+struct LinkView {
+  bool up;
+  bool peerRelay;
+  bool peerRelayKnown;
+  bool takenOver;
+  unsigned long heardAt;
+  unsigned long sent, received, bad, stale, failovers;
+};
+
+// One board: its sketch's entry points, wrapped so both namespaces look alike
+struct Node {
+  const char* name;
+  void (*setup)();
+  void (*loop)();
+  void (*setRelay)(bool);
+  void (*command)(bool);
+  void (*setMode)(uint8_t);
+  void (*restartLink)();
+  bool (*relay)();
+  LinkView (*link)();
+  uint8_t* ip;
+  uint8_t* target;
+  sim::Board* board;
+  bool powered;
+};
+
+#define NODE(ns, b)                                                                                          \
+  {                                                                                                          \
+    #ns, ns::setup, ns::loop, [](bool on) { ns::setRelay(on); }, [](bool on) { ns::linkCommand(on); },     \
+        [](uint8_t m) {                                                                                      \
+          ns::linkSettings.mode = (ns::LinkMode)m;                                                           \
+          ns::linkTouch(ns::LF_MODE);                                                                        \
+        },                                                                                                   \
+        [] {                                                                                                 \
+          ns::linkUdp.stop();                                                                                \
+          ns::boardLink = ns::BoardLink();                                                                   \
+          ns::linkBegin();                                                                                   \
+        },                                                                                                   \
+        [] { return ns::relayState; },                                                                       \
+        [] {                                                                                                 \
+          const ns::BoardLink& l = ns::boardLink;                                                            \
+          return LinkView{ l.up, l.peerRelay, l.peerRelayKnown, l.takenOver, l.heardAt, l.sent, l.received, l.bad,      \
+                           l.stale, l.failovers };                                                           \
+        },                                                                                                   \
+        ns::network.ip, ns::network.target, b, true                                                          \
+  }
+
+static sim::Board secondBoard;
+static Node a = NODE(boardA, &sim::defaultBoard);
+static Node b = NODE(boardB, &secondBoard);
+
+// Runs the enclosing block as the given board
+struct On {
+  sim::Board* was;
+  explicit On(Node& n) : was(sim::board) { sim::board = n.board; }
+  ~On() { sim::board = was; }
+};
+
+static Node& other(Node& n) {
+  return &n == &a ? b : a;
+}
+
+// The network between the boards. Every frame is lost, corrupted or
+// duplicated with the given odds, and delivered after delayMs plus up to
+// jitterMs, which reorders frames sent close together.
+struct Wire {
+  int lossPct = 0;
+  int corruptPct = 0;
+  int duplicatePct = 0;
+  unsigned long delayMs = 1;
+  unsigned long jitterMs = 0;
+  unsigned long frames = 0;
+  unsigned long lost = 0;
+
+  void carry(Node& from) {
+    Node& to = other(from);
+    auto& q = from.board->udpOut;
+    while (!q.empty()) {
+      sim::Datagram d = q.front();
+      q.pop_front();
+      if (d.port != LINK_PORT || memcmp(d.ip, to.ip, 4) != 0) continue;
+      memcpy(d.ip, from.ip, 4);   // the receiver sees the sender's address
+      frames++;
+      if (chance(lossPct)) {
+        lost++;
+        continue;
+      }
+      if (chance(corruptPct)) d.data[next() % d.data.size()] ^= 1 << next() % 8;
+      for (int copies = chance(duplicatePct) ? 2 : 1; copies; copies--) {
+        flight.push_back(Flight{ sim::ms + delayMs + (jitterMs ? next() % (jitterMs + 1) : 0), &to, d });
+      }
+    }
+  }
+
+  void deliver() {
+    for (size_t i = 0; i < flight.size();) {
+      if ((long)(sim::ms - flight[i].at) < 0) {
+        i++;
+        continue;
+      }
+      Node& to = *flight[i].to;
+      if (to.powered) {
+        On on(to);
+        sim::sendUdp(LINK_PORT, flight[i].d.data, flight[i].d.ip, LINK_PORT);
+      }
+      flight.erase(flight.begin() + i);
+    }
+  }
+
+ private:
+  struct Flight {
+    unsigned long at;
+    Node* to;
+    sim::Datagram d;
+  };
+  std::vector<Flight> flight;
+  uint32_t seed = 12345;
+
+  uint32_t next() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  }
+  bool chance(int pct) { return pct && (int)(next() % 100) < pct; }
+};
+
+static Wire wire;
+
+// Each millisecond: both boards' loops, then the network
+static void step() {
+  Node* nodes[] = { &a, &b };
+  for (Node* n : nodes) {
+    if (!n->powered) continue;
+    On on(*n);
+    n->loop();
+  }
+  for (Node* n : nodes) wire.carry(*n);
+  wire.deliver();
+}
+
+static void runFor(unsigned long ms) {
+  sim::advance(ms);
+}
+
+// Runs until cond holds or maxMs passes; the time it took
+static unsigned long waitFor(std::function<bool()> cond, unsigned long maxMs) {
+  unsigned long start = sim::ms;
+  while (!cond() && sim::ms - start < maxMs) sim::advance(1);
+  return sim::ms - start;
+}
+
+static void setRelay(Node& n, bool on) {
+  On use(n);
+  n.setRelay(on);
+}
+
+static void command(Node& n, bool on) {
+  On use(n);
+  n.command(on);
+}
+
+static void setMode(Node& n, uint8_t mode) {
+  On use(n);
+  n.setMode(mode);
+}
+
+// With a quarter of the frames lost each way, plus reordering and
+// duplicates, every relay change reaches the peer, and every command is
+// carried out once, in a few retries
+static void testLossyPeer() {
+  wire.lossPct = 25;
+  wire.duplicatePct = 10;
+  wire.jitterMs = 30;
+  unsigned long worst = 0, total = 0;
+  const int changes = 200;
+  for (int i = 0; i < changes; i++) {
+    bool on = i % 2 == 0;
+    setRelay(a, on);
+    unsigned long took = waitFor([on] { return b.link().peerRelayKnown && b.link().peerRelay == on; }, 5000);
+    worst = std::max(worst, took);
+    total += took;
+    runFor(50 + i % 7 * 40);   // changes at uneven intervals
+  }
+  printf("relay change seen by the peer at 25%% loss: avg %lu ms, worst %lu ms over %d changes\n", total / changes,
+         worst, changes);
+  CHECK_EQ(b.link().peerRelay, a.relay());
+  CHECK(worst <= 1000);
+
+  // Commands: B's relay follows each one once. B switches back locally
+  // as soon as it does, so a resend carried out again would show.
+  unsigned long staleBefore = b.link().stale;
+  for (int i = 0; i < 100; i++) {
+    bool on = i % 2 != 0;
+    setRelay(b, !on);
+    command(a, on);
+    CHECK(waitFor([on] { return b.relay() == on; }, 5000) < 1000);
+    setRelay(b, !on);
+    runFor(100 + i % 5 * 60);
+    CHECK_EQ(b.relay(), !on);
+  }
+  CHECK(b.link().stale > staleBefore);
+  printf("100 commands carried out once each; peer dropped %lu resent or reordered frames\n",
+         b.link().stale - staleBefore);
+
+  // The link stayed up throughout
+  CHECK(a.link().up && b.link().up);
+  printf("%lu frames, %lu lost, %lu failovers\n", wire.frames, wire.lost, a.link().failovers + b.link().failovers);
+  CHECK(a.link().failovers + b.link().failovers <= 1);
+  wire.duplicatePct = 0;
+  wire.jitterMs = 0;
+}
+
+// Corrupted frames are counted and dropped, and nothing they carried is
+// applied
+static void testCorruption() {
+  wire.lossPct = 0;
+  wire.corruptPct = 30;
+  unsigned long bad = a.link().bad + b.link().bad;
+  for (int i = 0; i < 50; i++) {
+    bool on = i % 2 == 0;
+    setRelay(a, on);
+    CHECK(waitFor([on] { return b.link().peerRelay == on; }, 3000) < 3000);
+    runFor(200);
+  }
+  CHECK(a.link().bad + b.link().bad > bad);
+  CHECK_EQ(b.link().peerRelay, a.relay());
+  wire.corruptPct = 0;
+}
+
+// Mirror mode: B's relay follows A's, lossy network or not
+static void testMirror() {
+  wire.lossPct = 25;
+  setMode(b, boardB::LINK_MIRROR);
+  for (int i = 0; i < 50; i++) {
+    bool on = i % 2 != 0;
+    setRelay(a, on);
+    CHECK(waitFor([on] { return b.relay() == on; }, 3000) < 1000);
+    runFor(300);
+  }
+  setMode(b, boardB::LINK_PEER);
+}
+
+// Standby: when A goes silent, B takes over A's last relay state within
+// LINK_TIMEOUT_MS, and goes back to its own once A returns. A's link
+// restarting (a new epoch) gets it B's full state again.
+static void testStandby() {
+  wire.lossPct = 10;
+  setMode(b, boardB::LINK_STANDBY);
+  setRelay(b, false);
+  setRelay(a, true);
+  CHECK(waitFor([] { return b.link().peerRelay; }, 3000) < 3000);
+  runFor(1000);
+
+  unsigned long failovers = b.link().failovers;
+  a.powered = false;
+  unsigned long took = waitFor([] { return b.relay(); }, 10000);
+  unsigned long silent = sim::ms - b.link().heardAt;
+  printf("standby took over %lu ms after the peer went silent, %lu ms after its last frame\n", took, silent);
+  CHECK(took <= LINK_TIMEOUT_MS);
+  CHECK(silent >= LINK_TIMEOUT_MS && silent <= LINK_TIMEOUT_MS + 2);
+  CHECK(b.link().takenOver);
+  CHECK_EQ(b.link().failovers, failovers + 1);
+
+  a.powered = true;
+  CHECK(waitFor([] { return !b.relay(); }, 3000) < 1500);
+  CHECK(!b.link().takenOver);
+
+  // A's link restarts with nothing known of B; B sends its state in full
+  {
+    On use(a);
+    a.restartLink();
+  }
+  CHECK(!a.link().peerRelayKnown);
+  CHECK(waitFor([] { return a.link().peerRelayKnown; }, 3000) < 1000);
+  CHECK_EQ(a.link().peerRelay, b.relay());
+  // and a fresh command id from A is still carried out
+  command(a, true);
+  CHECK(waitFor([] { return b.relay(); }, 3000) < 1000);
+  setMode(b, boardB::LINK_PEER);
+}
+
+// Browsers holding every socket they can get leave one for the ping
+// watchdog, which keeps sending its echoes
+static void testSocketBudget() {
+  unsigned long sent = boardA::pingStats[0].sent, waits = boardA::pingSocketWaits;
+  std::vector<int> held;
+  {
+    On use(a);
+    for (int i = 0; i < MAX_SOCK_NUM; i++) {
+      int c = sim::connect(HTTP_PORT);
+      if (c >= 0) held.push_back(c);
+      sim::advance(1);
+    }
+  }
+  CHECK(waitFor([sent] { return boardA::pingStats[0].sent > sent + 1; }, 3 * 60000UL) < 3 * 60000UL);
+  CHECK_EQ(boardA::pingSocketWaits, waits);
+  CHECK(held.size() >= SOCKETS_HTTP_MIN);
+  On use(a);
+  for (int c : held) sim::close(c);
+}
+
+int main() {
+  // The boards address each other
+  const uint8_t ipA[4] = { 192, 168, 1, 30 }, ipB[4] = { 192, 168, 1, 31 };
+  memcpy(a.ip, ipA, 4);
+  memcpy(a.target, ipB, 4);
+  memcpy(b.ip, ipB, 4);
+  memcpy(b.target, ipA, 4);
+  for (Node* n : { &a, &b }) {
+    Node* peer = &other(*n);
+    n->board->ping = [peer](const uint8_t*) { return peer->powered ? 1 : -1; };
+    On use(*n);
+    n->setup();
+  }
+  sim::peers.push_back(step);
+  CHECK(waitFor([] { return a.link().up && b.link().up; }, 1000) < 1000);
+
+  unsigned long blockedA = a.board->blockedMs, blockedB = b.board->blockedMs;
+  unsigned long allocsA = a.board->heapUse.allocs, allocsB = b.board->heapUse.allocs;
+  testLossyPeer();
+  testCorruption();
+  testMirror();
+  testStandby();
+  testSocketBudget();
+  CHECK_EQ(a.board->blockedMs, blockedA);
+  CHECK_EQ(b.board->blockedMs, blockedB);
+  CHECK_EQ(a.board->heapUse.allocs, allocsA);
+  CHECK_EQ(b.board->heapUse.allocs, allocsB);
+  return testResult("test_link");
+}
@@ -0,0 +1,49 @@
+// sketch: main.cpp
+// Logins (user-025): a wrong password turns the next attempts away without
+// hashing for 1, 2, 4 ... s up to LOGIN_BACKOFF_MAX_MS, the right one gets
+// in once the wait is over, and a success starts the backoff over.
+#include "main.cpp"
+#include "harness.h"
+
+static int login(const char* pass) {
+  return httpPost("/login", std::string("user=admin&pass=") + pass).status;
+}
+
+static void runFor(unsigned long ms) {
+  unsigned long start = sim::ms;
+  while (sim::ms - start < ms) sim::pass(1, 10);
+}
+
+// Each failure doubles the wait, during which even the right password is
+// refused with 429
+static void testBackoff() {
+  CHECK_EQ(login("wrong"), 401);
+  for (uint8_t failures = 1; failures <= 7; failures++) {
+    unsigned long wait = min(LOGIN_BACKOFF_MIN_MS << (failures - 1), LOGIN_BACKOFF_MAX_MS);
+    unsigned long at = sim::ms;
+    CHECK_EQ(login("1234"), 429);
+    runFor(wait - 100 - (sim::ms - at));
+    CHECK_EQ(login("1234"), 429);
+    runFor(200);
+    CHECK_EQ(login("wrong"), 401);
+  }
+  CHECK_EQ(loginGuard.failures, 8);
+}
+
+// A success clears the count; the next failure waits the minimum again
+static void testReset() {
+  runFor(LOGIN_BACKOFF_MAX_MS);
+  CHECK_EQ(login("1234"), 303);
+  CHECK_EQ(loginGuard.failures, 0);
+  CHECK_EQ(login("wrong"), 401);
+  runFor(LOGIN_BACKOFF_MIN_MS);
+  CHECK_EQ(login("1234"), 303);
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  testBackoff();
+  testReset();
+  return testResult("test_login");
+}
@@ -0,0 +1,218 @@
+// sketch: main.cpp
+// The Modbus TCP server (user-018) driven by a local Modbus client: each
+// function code against the register map, exception replies, frames split
+// or run together on the wire, and the cost of switching a relay over
+// Modbus against the same through GET /relayN/on.
+#include "main.cpp"
+#include "harness.h"
+
+// A Modbus TCP client on one connection to port 502
+struct ModbusClient {
+  int conn = -1;
+  uint16_t transaction = 0;
+  std::string in;
+
+  bool open() {
+    conn = sim::connect(MODBUS_PORT);
+    return conn >= 0;
+  }
+
+  // Sends a request PDU with the MBAP header; the raw frame, for splitting
+  std::string frame(const std::string& pdu) {
+    transaction++;
+    std::string f;
+    f += (char)(transaction >> 8);
+    f += (char)transaction;
+    f += std::string(2, '\0');
+    f += (char)((pdu.size() + 1) >> 8);
+    f += (char)(pdu.size() + 1);
+    f += (char)1;   // unit id
+    return f + pdu;
+  }
+
+  // The next reply PDU, after checking its header; "" if none came
+  std::string reply(unsigned long maxMs = 100) {
+    for (unsigned long t = 0; t < maxMs; t++) {
+      in += sim::receive(conn);
+      if (in.size() >= MODBUS_HEADER_SIZE) {
+        size_t length = ((uint8_t)in[4] << 8 | (uint8_t)in[5]);
+        if (in.size() >= 6 + length) {
+          std::string pdu = in.substr(MODBUS_HEADER_SIZE, length - 1);
+          in.erase(0, 6 + length);
+          return pdu;
+        }
+      }
+      sim::pass(1);
+    }
+    return "";
+  }
+
+  std::string request(const std::string& pdu) {
+    sim::send(conn, frame(pdu));
+    return reply();
+  }
+};
+
+static std::string pdu(std::initializer_list<int> bytes) {
+  std::string s;
+  for (int b : bytes) s += (char)b;
+  return s;
+}
+
+static std::string readRegs(uint8_t fc, uint16_t start, uint16_t count) {
+  return pdu({ fc, start >> 8, start & 0xFF, count >> 8, count & 0xFF });
+}
+
+static uint16_t reg(const std::string& reply, int i) {
+  return (uint8_t)reply[2 + 2 * i] << 8 | (uint8_t)reply[3 + 2 * i];
+}
+
+static ModbusClient mb;
+
+// A pin's level as its port register holds it, by the board's own port map
+static bool pinHigh(uint8_t pin) {
+  return *portOutputRegister(digitalPinToPort(pin)) & digitalPinToBitMask(pin);
+}
+
+static void testCoils() {
+  relaySettings[0].mode = MODE_BASIC;
+  relaySettings[1].mode = MODE_BASIC;
+  CHECK(mb.request(pdu({ 5, 0, 1, 0xFF, 0 })) == pdu({ 5, 0, 1, 0xFF, 0 }));
+  CHECK(relayState(1));
+  CHECK(mb.request(pdu({ 15, 0, 0, 0, 2, 1, 0x01 })) == pdu({ 15, 0, 0, 0, 2 }));
+  CHECK(relayState(0));
+  CHECK(!relayState(1));
+  CHECK(mb.request(readRegs(1, 0, RELAY_COUNT)) == pdu({ 1, 1, 0x01 }));
+  CHECK(pinHigh(RELAY1_PIN));
+  CHECK(!pinHigh(RELAY2_PIN));
+
+  // Every relay on reaches pins 5-8 and leaves the SPI pins alone
+  for (uint8_t i = 0; i < RELAY_COUNT; i++) relaySettings[i].mode = MODE_BASIC;
+  CHECK(mb.request(pdu({ 15, 0, 0, 0, 4, 1, 0x0F })) == pdu({ 15, 0, 0, 0, 4 }));
+  sim::pass(1);
+  for (uint8_t pin : { RELAY1_PIN, RELAY2_PIN, RELAY3_PIN, RELAY4_PIN }) CHECK(pinHigh(pin));
+  for (uint8_t pin = 50; pin <= 53; pin++) CHECK(!pinHigh(pin));
+  CHECK(mb.request(pdu({ 15, 0, 0, 0, 4, 1, 0x01 })) == pdu({ 15, 0, 0, 0, 4 }));
+  sim::pass(1);
+  CHECK(pinHigh(RELAY1_PIN));
+  CHECK(!pinHigh(RELAY4_PIN));
+}
+
+static void testRegisters() {
+  sensorPush(215, 480);
+  std::string r = mb.request(readRegs(4, 0, MODBUS_INPUTS));
+  CHECK_EQ(r.size(), 2 + 2 * MODBUS_INPUTS);
+  CHECK_EQ(reg(r, 0), 215);
+  CHECK_EQ(reg(r, 1), 480);
+  CHECK_EQ(reg(r, 2), 1);
+  CHECK_EQ(reg(r, 3) & 1, relayState(0));
+
+  // Relay 2's temp min to -5.0 C, then its window to 06:30-18:15 in one write
+  CHECK(mb.request(pdu({ 6, 0, 8 + 3, 0xFF, 0xCE })) == pdu({ 6, 0, 8 + 3, 0xFF, 0xCE }));
+  CHECK_EQ(relaySettings[1].tempMin, -50);
+  CHECK(mb.request(pdu({ 16, 0, 9, 0, 2, 4, 390 >> 8, 390 & 0xFF, 1095 >> 8, 1095 & 0xFF })) == pdu({ 16, 0, 9, 0, 2 }));
+  CHECK_EQ(relaySettings[1].timeSettings.startHour, 6);
+  CHECK_EQ(relaySettings[1].timeSettings.endMinute, 15);
+  r = mb.request(readRegs(3, 8, MODBUS_RELAY_REGS));
+  CHECK_EQ(reg(r, 1), 390);
+  CHECK_EQ(reg(r, 2), 1095);
+  CHECK_EQ((int16_t)reg(r, 3), -50);
+
+  // All or nothing: one bad value leaves the others unwritten
+  CHECK(mb.request(pdu({ 16, 0, 11, 0, 2, 4, 0, 100, 0x7F, 0xFF })) == pdu({ 0x90, MB_ILLEGAL_VALUE }));
+  CHECK_EQ(relaySettings[1].tempMin, -50);
+}
+
+static void testExceptions() {
+  CHECK(mb.request(pdu({ 7 })) == pdu({ 0x87, MB_ILLEGAL_FUNCTION }));
+  CHECK(mb.request(readRegs(1, RELAY_COUNT - 1, 2)) == pdu({ 0x81, MB_ILLEGAL_ADDRESS }));
+  CHECK(mb.request(readRegs(3, MODBUS_HOLDINGS, 1)) == pdu({ 0x83, MB_ILLEGAL_ADDRESS }));
+  CHECK(mb.request(readRegs(4, 0, MODBUS_MAX_REGS + 1)) == pdu({ 0x84, MB_ILLEGAL_VALUE }));
+  CHECK(mb.request(pdu({ 5, 0, 0, 0x12, 0x34 })) == pdu({ 0x85, MB_ILLEGAL_VALUE }));
+  CHECK(mb.request(pdu({ 6, 0, 0, 0, MODE_COUNT })) == pdu({ 0x86, MB_ILLEGAL_VALUE }));
+  // A relay in an automatic mode refuses coil writes as not allowed in
+  // that state
+  relaySettings[2].mode = MODE_TIME;
+  bool before = relayState(2);
+  CHECK(mb.request(pdu({ 5, 0, 2, before ? 0 : 0xFF, 0 })) == pdu({ 0x85, MB_ILLEGAL_FUNCTION }));
+  CHECK(mb.request(pdu({ 15, 0, 0, 0, 4, 1, 0x0F })) == pdu({ 0x8F, MB_ILLEGAL_FUNCTION }));
+  CHECK_EQ(relayState(2), before);
+  relaySettings[2].mode = MODE_BASIC;
+}
+
+// A frame a byte at a time, then two frames in one segment
+static void testFraming() {
+  std::string f = mb.frame(readRegs(3, 0, 1));
+  for (char c : f) {
+    sim::send(mb.conn, std::string(1, c));
+    sim::pass(1);
+  }
+  CHECK_EQ(mb.reply().size(), 4);
+  sim::send(mb.conn, mb.frame(readRegs(1, 0, 1)) + mb.frame(readRegs(4, 0, 1)));
+  CHECK_EQ(mb.reply()[0], 1);
+  CHECK_EQ(mb.reply()[0], 4);
+  CHECK(mb.in.empty());
+}
+
+// A header with a foreign protocol id closes the connection; a new client
+// is then served. Closing never waits on the peer, however slow it is to
+// finish the close, and a second client while one is served is refused, as
+// nothing listens on the port then.
+static void testBadHeader() {
+  unsigned long blocked = sim::board->blockedMs;
+  sim::closeDelayMs = 1500;
+  int second = sim::connect(MODBUS_PORT);
+  sim::send(second, mb.frame(readRegs(1, 0, 1)));
+  sim::pass(5);
+  CHECK(sim::closed(second));
+  CHECK(sim::receive(second).empty());
+
+  std::string f = mb.frame(readRegs(1, 0, 1));
+  f[2] = 1;
+  sim::send(mb.conn, f);
+  sim::pass(5);
+  CHECK(sim::closed(mb.conn));
+  CHECK(modbus.state == CONN_CLOSING);
+  sim::pass(MODBUS_CLOSE_TIMEOUT_MS / 10, 10);
+  CHECK(modbus.state == CONN_FREE);
+  CHECK_EQ(sim::board->blockedMs, blocked);
+  sim::closeDelayMs = 1;
+
+  CHECK(mb.open());
+  CHECK_EQ(mb.request(readRegs(1, 0, 1)).size(), 3);
+}
+
+// Switching a relay 200 times: Modbus on one connection against HTTP
+// keep-alive, in SPI bytes (chip traffic) and host time per request
+static void benchmark() {
+  sim::Board& b = *sim::board;
+  const int n = 200;
+  unsigned long allocs = b.heapUse.allocs, spi = b.spiBytes;
+  double t0 = hostSeconds();
+  for (int i = 0; i < n; i++) mb.request(pdu({ 5, 0, 0, i % 2 ? 0 : 0xFF, 0 }));
+  double modbusUs = (hostSeconds() - t0) * 1e6 / n;
+  unsigned long modbusSpi = (b.spiBytes - spi) / n;
+  CHECK_EQ(b.heapUse.allocs, allocs);
+
+  std::string auth = sessionCookie();
+  std::vector<std::string> reqs = { "GET /relay1/on HTTP/1.1\r\nHost: board\r\n" + auth + "\r\n",
+                                    "GET /relay1/off HTTP/1.1\r\nHost: board\r\n" + auth + "\r\n" };
+  LoadReport r = HttpLoad(reqs, 1, true).run(n);
+  CHECK_EQ(r.failures, 0);
+  printf("relay switch: Modbus %lu SPI bytes, %.1f us host; HTTP %lu SPI bytes, %.1f us host\n", modbusSpi, modbusUs,
+         r.spiBytes / n, r.hostSeconds * 1e6 / n);
+  CHECK(modbusSpi * 4 < r.spiBytes / n);
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  CHECK(mb.open());
+  testCoils();
+  testRegisters();
+  testExceptions();
+  testFraming();
+  testBadHeader();
+  benchmark();
+  return testResult("test_modbus");
+}
@@ -0,0 +1,364 @@
+// sketch: main.cpp
+// The MQTT client (user-020) against a stand-in broker: the session the
+// client sets up, retained state published once per change, commands on
+// the relay topics at QoS 0 and 1, resends of unacknowledged publishes,
+// keep-alive, reconnects with backoff that never block the loop, and a
+// socket kept for the client however many the web server is asked for.
+#include "main.cpp"
+#include "harness.h"
+
+#include <map>
+
+static const uint8_t BROKER_IP[4] = { 10, 0, 0, 5 };
+
+struct MqttPacket {
+  uint8_t header;
+  std::string body;
+  uint8_t type() const { return header >> 4; }
+};
+
+static std::string mqttString(const std::string& s) {
+  return std::string(1, (char)(s.size() >> 8)) + (char)s.size() + s;
+}
+
+static std::string mqttPacket(uint8_t header, const std::string& body) {
+  std::string s(1, (char)header);
+  size_t n = body.size();
+  do {
+    uint8_t b = n & 0x7F;
+    n >>= 7;
+    s += (char)(n ? b | 0x80 : b);
+  } while (n);
+  return s + body;
+}
+
+// One client at a time on port 1883. Keeps retained messages and a log of
+// every packet the client sent.
+struct Broker {
+  enum Mode { ACCEPT, NO_SYN, REFUSE, REJECT };   // REJECT: CONNACK code 5
+  Mode mode = ACCEPT;
+  bool ackPublishes = true;
+  bool answerPings = true;
+  int conn = -1;
+  std::string in;
+  std::vector<MqttPacket> log;
+  std::vector<unsigned long> connectAt;
+  std::map<std::string, std::string> retained;
+  std::vector<uint16_t> pubacks;      // packet ids the client acknowledged
+  std::vector<std::string> published; // topics, in order
+  uint16_t nextId = 100;
+
+  void step() {
+    int c = sim::outgoing(1883);
+    if (c >= 0 && c != conn && sim::socketOf(c) >= 0 && std::find(seen.begin(), seen.end(), c) == seen.end()) {
+      seen.push_back(c);
+      connectAt.push_back(sim::ms);
+      if (mode == REFUSE) sim::refuse(c);
+      else if (mode != NO_SYN) {
+        sim::accept(c);
+        conn = c;
+        in.clear();
+      }
+    }
+    if (conn < 0) return;
+    in += sim::receive(conn);
+    MqttPacket p;
+    while (take(p)) handle(p);
+  }
+
+  bool online() const { return conn >= 0 && !sim::closed(conn); }
+
+  void send(const std::string& packet) { sim::send(conn, packet); }
+
+  // Publishes to the client; the packet id for QoS 1
+  uint16_t publish(const std::string& topic, const std::string& payload, int qos) {
+    uint16_t id = nextId++;
+    std::string body = mqttString(topic) + (qos ? std::string(1, (char)(id >> 8)) + (char)id : "") + payload;
+    send(mqttPacket(0x30 | qos << 1, body));
+    return id;
+  }
+
+  void drop() {
+    sim::close(conn);
+    conn = -1;
+  }
+
+  size_t count(uint8_t type) const {
+    size_t n = 0;
+    for (const MqttPacket& p : log) n += p.type() == type;
+    return n;
+  }
+
+ private:
+  std::vector<int> seen;
+
+  bool take(MqttPacket& p) {
+    if (in.size() < 2) return false;
+    size_t length = 0, at = 1;
+    for (int shift = 0;; shift += 7) {
+      if (at >= in.size()) return false;
+      uint8_t b = in[at++];
+      length |= (size_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) break;
+    }
+    if (in.size() < at + length) return false;
+    p.header = in[0];
+    p.body = in.substr(at, length);
+    in.erase(0, at + length);
+    return true;
+  }
+
+  void handle(const MqttPacket& p) {
+    log.push_back(p);
+    switch (p.type()) {
+      case 1:   // CONNECT
+        send(mqttPacket(0x20, std::string("\0", 1) + (char)(mode == REJECT ? 5 : 0)));
+        if (mode == REJECT) drop();
+        break;
+      case 3: { // PUBLISH
+        size_t topicLen = (uint8_t)p.body[0] << 8 | (uint8_t)p.body[1];
+        std::string topic = p.body.substr(2, topicLen);
+        int qos = (p.header >> 1) & 3;
+        std::string payload = p.body.substr(2 + topicLen + (qos ? 2 : 0));
+        if (p.header & 1) retained[topic] = payload;
+        published.push_back(topic);
+        if (qos && ackPublishes) send(mqttPacket(0x40, p.body.substr(2 + topicLen, 2)));
+        break;
+      }
+      case 4:   // PUBACK
+        pubacks.push_back((uint8_t)p.body[0] << 8 | (uint8_t)p.body[1]);
+        break;
+      case 8:   // SUBSCRIBE
+        send(mqttPacket(0x90, p.body.substr(0, 2) + std::string(1, (char)1)));
+        break;
+      case 12:  // PINGREQ
+        if (answerPings) send(mqttPacket(0xD0, ""));
+        break;
+    }
+  }
+};
+
+static Broker broker;
+
+static void runFor(unsigned long ms) {
+  unsigned long start = sim::ms;
+  while (sim::ms - start < ms) sim::pass(1);
+}
+
+static std::string topic(const char* suffix) {
+  return std::string(mqttSettings.prefix) + suffix;
+}
+
+// CONNECT with a clean session and the offline will, then the wildcard
+// subscription and every relay's state plus online, retained
+static void testSession() {
+  memcpy(mqttSettings.broker, BROKER_IP, 4);
+  mqttRestart();
+  runFor(200);
+  CHECK(mqtt.state == MQTT_ONLINE);
+  CHECK(!broker.log.empty() && broker.log[0].type() == 1);
+  const std::string& connect = broker.log[0].body;
+  CHECK(connect.substr(0, 7) == mqttString("MQTT") + (char)4);
+  CHECK_EQ((uint8_t)connect[7], 0x26);
+  CHECK_EQ((uint8_t)connect[8] << 8 | (uint8_t)connect[9], MQTT_KEEPALIVE_S);
+  CHECK(connect.find(mqttString(topic("/status")) + mqttString("offline")) != std::string::npos);
+
+  CHECK_EQ(broker.count(8), 1);
+  CHECK(broker.log[1].body.substr(2) == mqttString(topic("/+/set")) + (char)1);
+  for (uint8_t i = 1; i <= RELAY_COUNT; i++) {
+    std::string t = topic("/relay") + std::to_string(i) + "/state";
+    CHECK(broker.retained[t] == (relayState(i - 1) ? "on" : "off"));
+  }
+  CHECK(broker.retained[topic("/status")] == "online");
+}
+
+// Nothing goes out while nothing changes; a switch is published once, at
+// once, and a sensor change at QoS 0
+static void testPublishOnChange() {
+  relaySettings[0].mode = MODE_BASIC;
+  size_t before = broker.published.size();
+  runFor(20000);
+  CHECK_EQ(broker.published.size(), before);
+
+  bool on = !relayState(0);
+  setRelayState(0, on);
+  unsigned long at = sim::ms;
+  while (broker.retained[topic("/relay1/state")] != (on ? "on" : "off") && sim::ms - at < 100) sim::pass(1);
+  printf("relay change published after %lu ms\n", sim::ms - at);
+  CHECK(sim::ms - at <= 5);
+  runFor(1000);
+  CHECK_EQ(broker.published.size(), before + 1);
+
+  sensorPush(215, 400);
+  runFor(100);
+  CHECK(broker.retained[topic("/sensor/temperature")] == "21.5");
+  CHECK(broker.retained[topic("/sensor/humidity")] == "40.0");
+  CHECK_EQ((broker.log.back().header >> 1) & 3, 0);
+}
+
+// Commands on relayN/set; a QoS 1 one is acknowledged with its id, even
+// when too big to handle
+static void testCommands() {
+  relaySettings[1].mode = MODE_BASIC;
+  uint16_t id = broker.publish(topic("/relay2/set"), "ON", 1);
+  runFor(50);
+  CHECK(relayState(1));
+  CHECK(std::find(broker.pubacks.begin(), broker.pubacks.end(), id) != broker.pubacks.end());
+  CHECK(broker.retained[topic("/relay2/state")] == "on");
+
+  broker.publish(topic("/relay2/set"), "0", 0);
+  runFor(50);
+  CHECK(!relayState(1));
+
+  // An automatic relay, a bad payload and a foreign topic change nothing;
+  // the first two restate the relay's state
+  relaySettings[2].mode = MODE_TIME;
+  bool state = relayState(2);
+  size_t before = broker.published.size();
+  broker.publish(topic("/relay3/set"), state ? "off" : "on", 1);
+  broker.publish(topic("/relay2/set"), "maybe", 1);
+  broker.publish(topic("/relay9x/set"), "on", 1);
+  runFor(100);
+  CHECK_EQ(relayState(2), state);
+  CHECK(!relayState(1));
+  CHECK_EQ(broker.published.size(), before + 2);
+  relaySettings[2].mode = MODE_BASIC;
+
+  // Packets too big for the buffer are skipped, but a QoS 1 one is still
+  // acknowledged, with its id after a short topic or a long one
+  before = broker.published.size();
+  uint16_t big = broker.publish(topic("/relay2/set"), "on" + std::string(200, ' '), 1);
+  uint16_t longTopic = broker.publish(topic("/relay2/set") + std::string(60, 'x'), "on", 1);
+  broker.publish(topic("/relay2/set"), std::string(300, 'x'), 0);
+  runFor(100);
+  CHECK(!relayState(1));
+  CHECK(std::find(broker.pubacks.begin(), broker.pubacks.end(), big) != broker.pubacks.end());
+  CHECK(std::find(broker.pubacks.begin(), broker.pubacks.end(), longTopic) != broker.pubacks.end());
+  CHECK_EQ(broker.published.size(), before);
+  CHECK(mqtt.state == MQTT_ONLINE);
+  // and the next command is handled as usual
+  broker.publish(topic("/relay2/set"), "on", 0);
+  runFor(50);
+  CHECK(relayState(1));
+  broker.publish(topic("/relay2/set"), "off", 0);
+  runFor(50);
+}
+
+// An unacknowledged state publish goes again with DUP after MQTT_RETRY_MS,
+// and nothing else is published meanwhile
+static void testResend() {
+  broker.ackPublishes = false;
+  setRelayState(3, !relayState(3));
+  runFor(50);
+  size_t publishes = broker.count(3);
+  const MqttPacket first = broker.log.back();
+  runFor(MQTT_RETRY_MS + 100);
+  CHECK_EQ(broker.count(3), publishes + 1);
+  CHECK_EQ(broker.log.back().header, first.header | 0x08);
+  CHECK(broker.log.back().body == first.body);
+  broker.ackPublishes = true;
+  runFor(MQTT_RETRY_MS + 100);
+  CHECK(mqtt.inflight == MQTT_NO_ITEM);
+}
+
+// PINGREQ after half the keep-alive without traffic; a broker gone silent
+// is dropped after 1.5 keep-alives
+static void testKeepAlive() {
+  size_t pings = broker.count(12);
+  runFor(MQTT_KEEPALIVE_S * 500UL + 1000);
+  CHECK_EQ(broker.count(12), pings + 1);
+  CHECK(mqtt.state == MQTT_ONLINE);
+
+  broker.answerPings = false;
+  unsigned long drops = mqtt.drops;
+  runFor(MQTT_KEEPALIVE_S * 1500UL);
+  CHECK_EQ(mqtt.drops, drops + 1);
+  broker.answerPings = true;
+}
+
+// Sensor readings changing every 10 s go out at QoS 0 and draw no answer;
+// half a keep-alive without hearing from the broker still sends a ping, so
+// the session stays up
+static void testQuietBroker() {
+  unsigned long drops = mqtt.drops;
+  size_t pings = broker.count(12), publishes = broker.count(3);
+  for (int i = 0; i < 30; i++) {
+    sensorPush(200 + i, 400);
+    runFor(10000);
+  }
+  CHECK(broker.count(3) >= publishes + 30);
+  CHECK_EQ(mqtt.drops, drops);
+  CHECK(broker.count(12) >= pings + 5);
+  CHECK(mqtt.state == MQTT_ONLINE);
+}
+
+// Lost connections come back after 2, 4, 8 ... s while the broker is
+// unreachable, refusing or rejecting; the web server is not held up
+static void testReconnect() {
+  runFor(MQTT_BACKOFF_MAX_S * 1000);
+  CHECK(mqtt.state == MQTT_ONLINE);
+
+  std::vector<std::string> reqs = { "GET /api/state HTTP/1.1\r\nHost: board\r\n" + sessionCookie() + "\r\n" };
+  LoadReport base = HttpLoad(reqs, 2, true).run(200);
+  const Broker::Mode modes[] = { Broker::NO_SYN, Broker::REFUSE, Broker::REJECT };
+  for (Broker::Mode mode : modes) {
+    broker.mode = mode;
+    broker.drop();
+    size_t first = broker.connectAt.size();
+    LoadReport r = HttpLoad(reqs, 2, true).run(200);
+    CHECK_EQ(r.failures, 0);
+    CHECK_EQ(r.blockedMs, 0);
+    CHECK(r.latency(1.0) <= base.latency(1.0) + 5);
+    unsigned long blocked = sim::board->blockedMs;
+    runFor(90000);
+    CHECK_EQ(sim::board->blockedMs, blocked);
+    // Attempts 2, 4, 8, 16 and 32 s after each failure ends
+    CHECK_EQ(broker.connectAt.size() - first, 5);
+    for (size_t i = first; i + 1 < broker.connectAt.size(); i++) {
+      unsigned long gap = broker.connectAt[i + 1] - broker.connectAt[i];
+      unsigned long wait = 2000UL << (i - first + 1);
+      unsigned long took = mode == Broker::NO_SYN ? MQTT_CONNECT_TIMEOUT_MS : 0;
+      CHECK(gap >= wait + took && gap <= wait + took + 50);
+    }
+    broker.mode = Broker::ACCEPT;
+    runFor(MQTT_BACKOFF_MAX_S * 1000);
+    CHECK(mqtt.state == MQTT_ONLINE);
+  }
+  printf("reconnects backed off 2, 4, 8, 16, 32 s; web max %lu ms throughout\n", base.latency(1.0));
+}
+
+// Web clients holding every socket they can get still leave one for MQTT
+// to reconnect on, and no claim goes without
+static void testSocketBudget() {
+  unsigned long waits = metrics.socketWaits;
+  broker.drop();
+  std::vector<int> held;
+  for (int i = 0; i < MAX_SOCK_NUM; i++) {
+    int c = sim::connect(HTTP_PORT);
+    if (c >= 0) held.push_back(c);
+    sim::pass(1);
+  }
+  runFor(5000);
+  CHECK(mqtt.state == MQTT_ONLINE);
+  CHECK_EQ(metrics.socketWaits, waits);
+  CHECK(held.size() >= SOCKETS_HTTP_MIN);
+  for (int c : held) sim::close(c);
+  runFor(100);
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  sim::peers.push_back([] { broker.step(); });
+  unsigned long allocs = sim::board->heapUse.allocs;
+  testSession();
+  testPublishOnChange();
+  testCommands();
+  testResend();
+  testKeepAlive();
+  testQuietBroker();
+  testReconnect();
+  testSocketBudget();
+  CHECK_EQ(sim::board->heapUse.allocs, allocs);
+  return testResult("test_mqtt");
+}
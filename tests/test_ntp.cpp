@@ -0,0 +1,176 @@
+// sketch: main.cpp
+// The SNTP client (user-012) against a local stand-in server: the first
+// sync sets the clock to within a few ms, the drift of millis() is learned
+// so the clock keeps time through a day without the server, a dead server
+// is retried with backoff, bad replies are refused, and nothing blocks.
+#include "main.cpp"
+#include "harness.h"
+
+#include <deque>
+#include <math.h>
+
+static const uint8_t NTP_SERVER_IP[4] = { 172, 16, 254, 1 };
+
+// Answers requests to port 123 after delayMs each way. Its clock runs ppm
+// faster than the board's millis(), and starts at startUnixMs.
+struct NtpServer {
+  enum Reply { GOOD, WRONG_ORIGIN, KISS_OF_DEATH, CLIENT_MODE, OTHER_PORT, SHORT, SILENT };
+  Reply reply = GOOD;
+  double ppm = 0;
+  double startUnixMs = 0;
+  unsigned long delayMs = 15;
+  unsigned long requests = 0;
+
+  double unixMs(unsigned long t) const { return startUnixMs + t * (1 + ppm / 1e6); }
+
+  void step() {
+    sim::Datagram d;
+    while (sim::receiveUdp(NTP_PORT, d)) {
+      requests++;
+      if (reply == SILENT || memcmp(d.ip, NTP_SERVER_IP, 4) != 0 || d.data.size() != NTP_PACKET_SIZE) continue;
+      // Stamped on arrival, delivered one delay later
+      Pending p = { sim::ms + 2 * delayMs, unixMs(sim::ms + delayMs), d.localPort, d.data.substr(40, 8) };
+      pending.push_back(p);
+    }
+    while (!pending.empty() && (long)(sim::ms - pending.front().due) >= 0) {
+      const Pending& p = pending.front();
+      std::string packet(NTP_PACKET_SIZE, '\0');
+      packet[0] = reply == CLIENT_MODE ? 0x23 : 0x24;   // version 4, server
+      packet[1] = reply == KISS_OF_DEATH ? 0 : 2;
+      packet.replace(24, 8, reply == WRONG_ORIGIN ? std::string(8, 'x') : p.origin);
+      double seconds = floor(p.stampMs / 1000);
+      uint32_t fraction = (uint32_t)((p.stampMs - seconds * 1000) / 1000 * 4294967296.0);
+      putBE32(packet, 32, (uint32_t)seconds + NTP_UNIX_OFFSET);
+      putBE32(packet, 40, (uint32_t)seconds + NTP_UNIX_OFFSET);
+      putBE32(packet, 44, fraction);
+      if (reply == SHORT) packet.resize(40);
+      sim::sendUdp(p.localPort, packet, NTP_SERVER_IP, reply == OTHER_PORT ? 1123 : NTP_PORT);
+      pending.pop_front();
+    }
+  }
+
+ private:
+  struct Pending {
+    unsigned long due;
+    double stampMs;
+    uint16_t localPort;
+    std::string origin;
+  };
+  std::deque<Pending> pending;
+
+  static void putBE32(std::string& s, size_t at, uint32_t v) {
+    for (int i = 0; i < 4; i++) s[at + i] = (char)(v >> (24 - 8 * i));
+  }
+};
+
+static NtpServer timeServer;
+
+// The board's clock minus the server's, in ms. The clock task ticks once a
+// second; the clock is first brought up to millis() as its next tick would.
+static double clockError() {
+  clockAdvance();
+  double board = clockSeconds * 1000.0 + clockMicros / 1000.0;
+  return board - timeServer.unixMs(sim::ms);
+}
+
+// Runs the board for ms, in 1 ms passes around a request and 100 ms ones
+// otherwise, so days of simulated time stay quick
+static void runFor(unsigned long ms) {
+  unsigned long start = sim::ms;
+  while (sim::ms - start < ms) {
+    bool busy = ntp.state == NTP_WAITING || (long)(ntp.nextAt - millis()) <= 100;
+    sim::pass(1, busy ? 1 : 100);
+  }
+}
+
+static void requestNow() {
+  ntp.nextAt = millis();
+  ntp.state = NTP_IDLE;
+}
+
+// Every kind of bad reply leaves the clock unset
+static void testBadReplies() {
+  const NtpServer::Reply bad[] = { NtpServer::WRONG_ORIGIN, NtpServer::KISS_OF_DEATH, NtpServer::CLIENT_MODE,
+                                   NtpServer::OTHER_PORT, NtpServer::SHORT, NtpServer::SILENT };
+  for (NtpServer::Reply r : bad) {
+    timeServer.reply = r;
+    requestNow();
+    unsigned long requests = timeServer.requests;
+    runFor(NTP_TIMEOUT_MS + 100);
+    CHECK_EQ(timeServer.requests, requests + 1);
+    CHECK(!ntp.synced);
+    CHECK(ntp.state == NTP_IDLE);
+  }
+  CHECK(clockSeconds < 86400);
+  timeServer.reply = NtpServer::GOOD;
+}
+
+static void testFirstSync() {
+  requestNow();
+  runFor(1000);
+  CHECK(ntp.synced);
+  CHECK(ntp.rttMs >= 2 * timeServer.delayMs && ntp.rttMs < 2 * timeServer.delayMs + 5);
+  double error = clockError();
+  printf("first sync: error %.1f ms, round trip %u ms\n", error, ntp.rttMs);
+  CHECK(fabs(error) < 5);
+  CHECK_EQ(weekdayOf(clockSeconds / 86400), 3);   // 1 January 2026, a Thursday
+  CHECK_EQ(clockSeconds % 86400 / 3600, 10);
+}
+
+// Hourly syncs against a server 500 ppm ahead of millis(): the measured
+// drift settles near 500 and the error between syncs stays small
+static void testDrift() {
+  double worst = 0;
+  for (int hour = 0; hour < 16; hour++) {
+    runFor(3600000UL - 1000);
+    if (hour >= 8) worst = std::max(worst, fabs(clockError()));   // just before the next sync
+    runFor(1000);
+  }
+  printf("drift after 16 h: %d ppm (server 500), worst error before a sync in the last 8 h %.1f ms\n",
+         clockSettings.driftPpm, worst);
+  CHECK(abs(clockSettings.driftPpm - 500) <= 25);
+  CHECK(worst < 250);
+  CHECK(ntp.syncs >= 16);
+}
+
+// A day with the server gone: the clock free-runs on the learned drift and
+// the retries back off
+static void testHoldover() {
+  requestNow();
+  runFor(1000);
+  CHECK(fabs(clockError()) < 5);
+  timeServer.reply = NtpServer::SILENT;
+  unsigned long requests = timeServer.requests;
+  runFor(86400000UL);
+  double error = clockError();
+  unsigned long retries = timeServer.requests - requests;
+  printf("a day without the server: error %.0f ms (%.0f ms uncorrected), %lu requests\n", error,
+         500e-6 * 86400000.0, retries);
+  CHECK(fabs(error) < 2000);
+  CHECK(retries > 10 && retries < 60);
+  CHECK_EQ(ntp.failures, 8);
+
+  // Back again: picked up by the next retry, at most the longest backoff away
+  timeServer.reply = NtpServer::GOOD;
+  unsigned long syncs = ntp.syncs, back = sim::ms;
+  while (ntp.syncs == syncs && sim::ms - back < (NTP_RETRY_MS << 7) + NTP_TIMEOUT_MS + 1000) runFor(100);
+  CHECK(ntp.syncs > syncs);
+  CHECK_EQ(ntp.failures, 0);
+  CHECK(fabs(clockError()) < 5);
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  timeServer.ppm = 500;
+  timeServer.startUnixMs = 1767261600000.0;   // 2026-01-01 10:00:00 UTC
+  sim::peers.push_back([] { timeServer.step(); });
+  sim::board->udpOut.clear();   // the request setup() sent with no server up
+  unsigned long blocked = sim::board->blockedMs;
+  testBadReplies();
+  testFirstSync();
+  testDrift();
+  testHoldover();
+  CHECK_EQ(sim::board->blockedMs, blocked);
+  return testResult("test_ntp");
+}
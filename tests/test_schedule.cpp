@@ -0,0 +1,117 @@
+// sketch: main.cpp
+// Weekly bitmap schedules (user-011): a simulated week of clock ticks
+// switches every relay exactly when its schedule says, and a benchmark of
+// RAM and lookup cost against the single daily TimeWindow they replaced.
+#include "main.cpp"
+#include "harness.h"
+
+static bool inWindow(unsigned long minute, unsigned long from, unsigned long to) {
+  return from <= to ? minute >= from && minute < to : minute >= from || minute < to;
+}
+
+// What relay i should be at absolute time t, worked out from scratch
+static bool expected(uint8_t i, unsigned long t) {
+  unsigned long minute = t % 86400 / 60;
+  uint8_t weekday = weekdayOf(t / 86400);
+  bool weekend = weekday >= 5;
+  switch (i) {
+    case 0:
+      if (weekend) return inWindow(minute, 10 * 60, 23 * 60);
+      return inWindow(minute, 7 * 60, 9 * 60) || inWindow(minute, 17 * 60, 22 * 60 + 30);
+    case 1:
+      return inWindow(minute, 22 * 60, 6 * 60);
+    default:
+      return false;
+  }
+}
+
+static void configureSchedules() {
+  WeeklySchedule& a = relaySchedules[0];
+  memset(&a, 0, sizeof(a));
+  scheduleSetSlots(a, 0, 7 * 4, 9 * 4, true);
+  scheduleSetSlots(a, 0, 17 * 4, 22 * 4 + 2, true);
+  scheduleSetSlots(a, 1, 10 * 4, 23 * 4, true);
+  a.profileDays = (1 << 5) | (1 << 6);   // Saturday, Sunday
+  TimeWindow night;
+  night.startHour = 22;
+  night.startMinute = 0;
+  night.endHour = 6;
+  night.endMinute = 0;
+  scheduleSetDaily(relaySchedules[1], night);
+  for (uint8_t i = 2; i < RELAY_COUNT; i++) memset(&relaySchedules[i], 0, sizeof(WeeklySchedule));
+  for (uint8_t i = 0; i < RELAY_COUNT; i++) relaySettings[i].mode = MODE_TIME;
+}
+
+// A week of minute ticks, starting mid-slot on a Wednesday
+static void testWeek() {
+  weekdayOfDayZero = 0;
+  clockSet(2 * 86400UL + 3 * 3600 + 7 * 60 + 13, 0);
+  unsigned long mismatches = 0, ticks = 0, start = clockSeconds;
+  for (unsigned long t = start; t < start + 7 * 86400UL; t += 60) {
+    clockSeconds = t;
+    scheduleRun();
+    ticks++;
+    for (uint8_t i = 0; i < RELAY_COUNT; i++) {
+      if (relayState(i) != expected(i, t)) mismatches++;
+    }
+  }
+  CHECK_EQ(mismatches, 0);
+  CHECK(ticks == 7 * 24 * 60);
+  // Relays with no edge queue nothing
+  CHECK(scheduleSize <= 3);
+}
+
+// An edge is found a week out, and a schedule that never changes has none
+static void testNextEdge() {
+  WeeklySchedule ws = {};
+  CHECK_EQ(scheduleNextEdge(ws, 12345), 0);
+  scheduleSetSlots(ws, 1, 0, 1, true);
+  ws.profileDays = 1 << 0;   // Monday only
+  weekdayOfDayZero = 0;
+  CHECK_EQ(scheduleNextEdge(ws, 86400), 6 * 86400UL);
+  CHECK_EQ(scheduleNextEdge(ws, 7 * 86400UL + 100), 800);
+}
+
+static volatile unsigned long sink;
+
+static void benchmark() {
+  const int rounds = 2000000;
+  TimeWindow w;
+  double t0 = hostSeconds();
+  for (int i = 0; i < rounds; i++) sink += windowContains(w, (i * 7919UL) % 86400);
+  double windowNs = (hostSeconds() - t0) * 1e9 / rounds;
+  t0 = hostSeconds();
+  for (int i = 0; i < rounds; i++) {
+    unsigned long t = i * 7919UL;
+    sink += scheduleBit(relaySchedules[0], weekdayOf(t / 86400), t % 86400 / SCHEDULE_SLOT_SECONDS);
+  }
+  double bitNs = (hostSeconds() - t0) * 1e9 / rounds;
+
+  // A clock tick: the heap's top compared once, against every relay's
+  // window checked again as before
+  t0 = hostSeconds();
+  for (int i = 0; i < rounds; i++) scheduleRun();
+  double runNs = (hostSeconds() - t0) * 1e9 / rounds;
+  t0 = hostSeconds();
+  for (int i = 0; i < rounds; i++) {
+    for (uint8_t r = 0; r < RELAY_COUNT; r++) sink += windowContains(w, (i * 7919UL) % 86400);
+  }
+  double pollNs = (hostSeconds() - t0) * 1e9 / rounds;
+
+  printf("lookup: window %.1f ns, bitmap %.1f ns; tick: %d windows %.1f ns, heap top %.1f ns\n", windowNs, bitNs,
+         RELAY_COUNT, pollNs, runNs);
+  // Byte-only structs, so these are the AVR sizes too
+  printf("RAM per relay: bitmap %zu bytes (any windows, 2 day profiles), TimeWindow %zu bytes (1 window)\n",
+         sizeof(WeeklySchedule), sizeof(TimeWindow));
+  CHECK_EQ(sizeof(WeeklySchedule), 25);
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  configureSchedules();
+  testWeek();
+  testNextEdge();
+  benchmark();
+  return testResult("test_schedule");
+}
@@ -0,0 +1,115 @@
+// sketch: main.cpp
+// The DHT11 sampler and temp mode (user-013), replaying temperature traces
+// through the simulated sensor: noise around a threshold does not make a
+// relay chatter, single bad reads never reach it, a silent sensor switches
+// it off, and sampling never blocks the loop.
+#include "main.cpp"
+#include "harness.h"
+
+#include <math.h>
+
+// Readings the sensor gave, in order, for comparing with the relay
+static std::vector<sim::DhtReading> delivered;
+
+// Replays trace(ms) on the simulated sensor
+static void replay(std::function<sim::DhtReading(unsigned long)> trace) {
+  sim::board->dht = [trace](unsigned long ms) {
+    sim::DhtReading r = trace(ms);
+    delivered.push_back(r);
+    return r;
+  };
+  delivered.clear();
+}
+
+static void runFor(unsigned long ms) {
+  unsigned long start = sim::ms;
+  while (sim::ms - start < ms) sim::pass(1, 10);
+}
+
+// A deterministic noise in [-n, n]
+static int16_t noise(unsigned long ms, int n) {
+  unsigned long x = ms * 2654435761UL;
+  return (int16_t)((x >> 16) % (2 * n + 1)) - n;
+}
+
+static unsigned long switches() {
+  return metrics.switches[0];
+}
+
+// An hour around tempMin: a slow swing of 1 C with 0.3 C of noise on top.
+// A bare threshold on the raw readings would flap on every noisy pass;
+// the relay follows the swing only.
+static void testNoisyThreshold() {
+  replay([](unsigned long ms) {
+    double swing = 10 * sin(ms / 600000.0 * 2 * M_PI);   // 10 minute period
+    return sim::DhtReading{ true, (int16_t)(200 + lround(swing) + noise(ms, 3)), 500 };
+  });
+  unsigned long before = switches();
+  runFor(3600000UL);
+  unsigned long relaySwitches = switches() - before;
+  unsigned long rawSwitches = 0;
+  for (size_t i = 1; i < delivered.size(); i++) {
+    if ((delivered[i].temp >= 200) != (delivered[i - 1].temp >= 200)) rawSwitches++;
+  }
+  printf("noisy swing around tempMin for 1 h: %zu readings, %lu relay switches, %lu on a bare threshold\n",
+         delivered.size(), relaySwitches, rawSwitches);
+  CHECK(delivered.size() >= 1700);   // one every 2 s
+  CHECK(relaySwitches <= 12);      // once each way per swing
+  CHECK(relaySwitches >= 10);
+  CHECK(rawSwitches > 4 * relaySwitches);
+}
+
+// Steady inside the range with a wild reading every tenth sample, some in
+// range for the sensor and some not: the relay stays on
+static void testSpikes() {
+  replay([](unsigned long ms) {
+    unsigned long n = ms / DHT_PERIOD_MS;
+    int16_t temp = n % 10 == 3 ? 790 : n % 10 == 7 ? -50 : 250;
+    return sim::DhtReading{ true, temp, n % 10 == 5 ? (int16_t)950 : (int16_t)500 };
+  });
+  runFor(20000);
+  CHECK(relayState(0));
+  unsigned long before = switches();
+  runFor(600000);
+  CHECK_EQ(switches(), before);
+  CHECK(relayState(0));
+  CHECK_EQ(sensor.temp, 250);
+  CHECK_EQ(sensor.humidity, 500);
+}
+
+// A sensor that stops answering: each try counts an error, and after
+// SENSOR_STALE_MS the readings are dropped and the relay switches off
+static void testSilentSensor() {
+  replay([](unsigned long) { return sim::DhtReading{ false, 0, 0 }; });
+  unsigned long errors = sensor.errors;
+  runFor(SENSOR_STALE_MS - 5000);
+  CHECK(sensor.valid);
+  CHECK(relayState(0));
+  runFor(10000);
+  CHECK(!sensor.valid);
+  CHECK(!relayState(0));
+  CHECK(sensor.errors - errors >= (SENSOR_STALE_MS + 5000) / DHT_PERIOD_MS - 1);
+
+  // Back: on again once the readings are inside the range by the margin
+  replay([](unsigned long) { return sim::DhtReading{ true, 250, 500 }; });
+  runFor(5000);
+  CHECK(sensor.valid);
+  CHECK(relayState(0));
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  RelaySettings& relay = relaySettings[0];
+  relay.mode = MODE_TEMP;
+  relay.tempMin = 200;
+  relay.tempMax = 300;
+  relay.humidityMin = 300;
+  relay.humidityMax = 700;
+  unsigned long blocked = sim::board->blockedMs;
+  testNoisyThreshold();
+  testSpikes();
+  testSilentSensor();
+  CHECK_EQ(sim::board->blockedMs, blocked);
+  return testResult("test_sensor");
+}
@@ -0,0 +1,300 @@
+// sketch: main.cpp
+// The SNMP v2c agent (user-019) with an in-process manager standing in for
+// the net-snmp tools: a GetNext walk and a GetBulk walk of the whole MIB
+// agree and come back in order, Get, Set and the community checks behave
+// as snmpget/snmpset expect, and malformed or mutated requests are dropped
+// without a reply or heap use.
+#include "main.cpp"
+#include "harness.h"
+
+typedef std::vector<unsigned long> Oid;
+
+// === BER, manager side ===
+static std::string tlv(uint8_t tag, const std::string& content) {
+  std::string s(1, (char)tag);
+  size_t n = content.size();
+  if (n >= 0x100) s += (char)0x82, s += (char)(n >> 8), s += (char)n;
+  else if (n >= 0x80) s += (char)0x81, s += (char)n;
+  else s += (char)n;
+  return s + content;
+}
+
+static std::string berInt(long v) {
+  std::string s;
+  for (int i = 3; i >= 0; i--) s += (char)(v >> (8 * i));
+  while (s.size() > 1 && (((uint8_t)s[0] == 0 && !(s[1] & 0x80)) || ((uint8_t)s[0] == 0xFF && (s[1] & 0x80)))) s.erase(0, 1);
+  return tlv(BER_INTEGER, s);
+}
+
+static std::string berOid(const Oid& oid) {
+  std::string s(1, (char)(oid[0] * 40 + oid[1]));
+  for (size_t i = 2; i < oid.size(); i++) {
+    std::string arc;
+    unsigned long v = oid[i];
+    arc += (char)(v & 0x7F);
+    while (v >>= 7) arc.insert(0, 1, (char)(0x80 | (v & 0x7F)));
+    s += arc;
+  }
+  return tlv(BER_OID, s);
+}
+
+struct Binding {
+  Oid oid;
+  uint8_t tag = 0;
+  long num = 0;
+  std::string text;
+};
+
+struct Reply {
+  bool got = false;
+  long requestId = 0, errorStatus = 0, errorIndex = 0;
+  std::vector<Binding> bindings;
+};
+
+// Splits one TLV off the front of s; false if it does not fit
+static bool take(std::string& s, uint8_t& tag, std::string& content) {
+  if (s.size() < 2) return false;
+  tag = s[0];
+  size_t len = (uint8_t)s[1], at = 2;
+  if (len & 0x80) {
+    size_t n = len & 0x7F;
+    len = 0;
+    for (size_t i = 0; i < n; i++) len = len << 8 | (uint8_t)s[at++];
+  }
+  if (s.size() < at + len) return false;
+  content = s.substr(at, len);
+  s.erase(0, at + len);
+  return true;
+}
+
+static long decodeInt(const std::string& c, bool isUnsigned) {
+  long v = isUnsigned ? 0 : (int8_t)c[0];
+  for (size_t i = isUnsigned ? 0 : 1; i < c.size(); i++) v = v << 8 | (uint8_t)c[i];
+  return v;
+}
+
+static Oid decodeOid(const std::string& c) {
+  Oid oid = { (unsigned long)(uint8_t)c[0] / 40, (unsigned long)(uint8_t)c[0] % 40 };
+  unsigned long v = 0;
+  for (size_t i = 1; i < c.size(); i++) {
+    v = v << 7 | (c[i] & 0x7F);
+    if (!(c[i] & 0x80)) oid.push_back(v), v = 0;
+  }
+  return oid;
+}
+
+static Reply decode(std::string msg) {
+  Reply r;
+  uint8_t tag;
+  std::string c, pdu, list, vb, part;
+  if (!take(msg, tag, c) || tag != BER_SEQUENCE) return r;
+  if (!take(c, tag, part) || !take(c, tag, part) || !take(c, tag, pdu) || tag != SNMP_RESPONSE) return r;
+  take(pdu, tag, part);
+  r.requestId = decodeInt(part, false);
+  take(pdu, tag, part);
+  r.errorStatus = decodeInt(part, false);
+  take(pdu, tag, part);
+  r.errorIndex = decodeInt(part, false);
+  take(pdu, tag, list);
+  while (take(list, tag, vb)) {
+    Binding b;
+    take(vb, tag, part);
+    b.oid = decodeOid(part);
+    take(vb, b.tag, part);
+    if (b.tag == BER_OCTET_STRING) b.text = part;
+    else if (b.tag == BER_OID) b.text = part;
+    else if (!part.empty()) b.num = decodeInt(part, b.tag != BER_INTEGER);
+    r.bindings.push_back(b);
+  }
+  r.got = true;
+  return r;
+}
+
+// === Manager ===
+static long requestId = 1000;
+
+static std::string message(uint8_t pduTag, const std::string& community, const std::vector<std::string>& bindings,
+                           long a = 0, long b = 0) {
+  std::string list;
+  for (const std::string& vb : bindings) list += vb;
+  std::string pdu = berInt(++requestId) + berInt(a) + berInt(b) + tlv(BER_SEQUENCE, list);
+  return tlv(BER_SEQUENCE, berInt(1) + tlv(BER_OCTET_STRING, community) + tlv(pduTag, pdu));
+}
+
+static std::string nullBinding(const Oid& oid) {
+  return tlv(BER_SEQUENCE, berOid(oid) + std::string("\x05\x00", 2));
+}
+
+static std::string intBinding(const Oid& oid, long v) {
+  return tlv(BER_SEQUENCE, berOid(oid) + berInt(v));
+}
+
+// Sends a datagram to the agent and waits a few passes for its answer
+static Reply exchange(const std::string& datagram) {
+  sim::sendUdp(SNMP_PORT, datagram);
+  sim::Datagram d;
+  for (int i = 0; i < 10; i++) {
+    sim::pass(1);
+    if (sim::receiveUdp(40000, d)) {
+      Reply r = decode(d.data);
+      CHECK(r.got);
+      CHECK_EQ(r.requestId, requestId);
+      return r;
+    }
+  }
+  return Reply();
+}
+
+static Reply get(uint8_t pduTag, const std::vector<Oid>& oids, const char* community = "public", long a = 0,
+                 long b = 0) {
+  std::vector<std::string> bindings;
+  for (const Oid& oid : oids) bindings.push_back(nullBinding(oid));
+  return exchange(message(pduTag, community, bindings, a, b));
+}
+
+static Oid enterprise(std::initializer_list<unsigned long> tail) {
+  Oid oid = { 1, 3, 6, 1, 4, 1, SNMP_ENTERPRISE, 1 };
+  oid.insert(oid.end(), tail);
+  return oid;
+}
+
+static Oid tableCell(unsigned long column, unsigned long relay) {
+  return enterprise({ 1, 1, column, relay });
+}
+
+// === Tests ===
+static std::vector<Binding> walked;
+
+// snmpwalk -v2c -c public: GetNext from the top until endOfMibView
+static void testWalk() {
+  Oid at = { 1, 3 };
+  int requests = 0;
+  for (;;) {
+    Reply r = get(SNMP_GET_NEXT, { at });
+    requests++;
+    if (!r.got || r.bindings.size() != 1 || r.bindings[0].tag == BER_END_OF_MIB_VIEW) break;
+    CHECK(r.bindings[0].oid > at);
+    at = r.bindings[0].oid;
+    walked.push_back(r.bindings[0]);
+  }
+  CHECK_EQ(walked.size(), SNMP_LEAVES);
+  CHECK(walked[0].text == "Arman Relay Control");
+  CHECK(walked[0].oid == Oid({ 1, 3, 6, 1, 2, 1, 1, 1, 0 }));
+  CHECK_EQ(walked[2].tag, BER_TIMETICKS);
+  // Relay table column 3 (window start) in minutes of the day
+  for (const Binding& b : walked) {
+    if (b.oid.size() == 12 && b.oid[9] == 3) {
+      const TimeWindow& w = relaySettings[b.oid[11] - 1].timeSettings;
+      CHECK_EQ(b.num, w.startHour * 60 + w.startMinute);
+    }
+  }
+  printf("GetNext walk: %zu leaves in %d requests\n", walked.size(), requests);
+}
+
+// snmpbulkwalk: the same leaves and values, in far fewer requests
+static void testBulkWalk() {
+  Oid at = { 1, 3 };
+  std::vector<Binding> bulk;
+  int requests = 0;
+  bool end = false;
+  while (!end && requests < 100) {
+    Reply r = get(SNMP_GET_BULK, { at }, "public", 0, 10);
+    requests++;
+    CHECK(!r.bindings.empty());
+    for (const Binding& b : r.bindings) {
+      if (b.tag == BER_END_OF_MIB_VIEW) {
+        end = true;
+        break;
+      }
+      bulk.push_back(b);
+      at = b.oid;
+    }
+  }
+  CHECK_EQ(bulk.size(), walked.size());
+  for (size_t i = 0; i < bulk.size() && i < walked.size(); i++) {
+    CHECK(bulk[i].oid == walked[i].oid);
+    if (bulk[i].tag != BER_TIMETICKS) CHECK_EQ(bulk[i].num, walked[i].num);
+  }
+  printf("GetBulk walk, 10 repetitions: %zu leaves in %d requests\n", bulk.size(), requests);
+  CHECK(requests <= (int)(SNMP_LEAVES + 9) / 10 + 1);
+}
+
+static void testGet() {
+  Reply r = get(SNMP_GET, { tableCell(5, 2), enterprise({ 2, 9, 0 }), enterprise({ 2, 1, 0 }) });
+  CHECK_EQ(r.errorStatus, 0);
+  CHECK_EQ(r.bindings.size(), 3);
+  CHECK_EQ(r.bindings[0].num, relaySettings[1].tempMin);
+  CHECK_EQ(r.bindings[1].tag, BER_NO_SUCH_OBJECT);
+  CHECK_EQ(r.bindings[2].num, sensor.temp);
+}
+
+// snmpset -c private: applied together, or not at all
+static void testSet() {
+  relaySettings[0].mode = MODE_BASIC;
+  Reply r = exchange(message(SNMP_SET, "private", { intBinding(tableCell(1, 1), 1), intBinding(tableCell(5, 1), 123) }));
+  CHECK_EQ(r.errorStatus, 0);
+  CHECK(relayState(0));
+  CHECK_EQ(relaySettings[0].tempMin, 123);
+
+  r = exchange(message(SNMP_SET, "private", { intBinding(tableCell(5, 1), 150), intBinding(tableCell(6, 1), 9999) }));
+  CHECK_EQ(r.errorStatus, SNMP_WRONG_VALUE);
+  CHECK_EQ(r.errorIndex, 2);
+  CHECK_EQ(relaySettings[0].tempMin, 123);
+
+  r = exchange(message(SNMP_SET, "private", { intBinding(tableCell(9, 1), 0) }));
+  CHECK_EQ(r.errorStatus, SNMP_NOT_WRITABLE);
+  relaySettings[3].mode = MODE_TIME;
+  r = exchange(message(SNMP_SET, "private", { intBinding(tableCell(1, 4), !relayState(3)) }));
+  CHECK_EQ(r.errorStatus, SNMP_INCONSISTENT_VALUE);
+  relaySettings[3].mode = MODE_BASIC;
+}
+
+// Wrong communities get no answer at all, as the tools time out
+static void testCommunities() {
+  unsigned long bad = snmpStats.badCommunity;
+  CHECK(!get(SNMP_GET, { tableCell(1, 1) }, "wrong").got);
+  CHECK(!exchange(message(SNMP_SET, "public", { intBinding(tableCell(1, 1), 0) })).got);
+  CHECK(relayState(0));
+  CHECK_EQ(snmpStats.badCommunity, bad + 2);
+  // The write community may read too
+  CHECK(get(SNMP_GET, { tableCell(1, 1) }, "private").got);
+}
+
+// Truncated, oversized and randomly mutated requests: dropped or answered,
+// never a crash or a heap allocation
+static void testMalformed() {
+  sim::Board& b = *sim::board;
+  unsigned long allocs = b.heapUse.allocs, errors = snmpStats.parseErrors;
+  std::string good = message(SNMP_GET, "public", { nullBinding(tableCell(1, 1)) });
+  for (size_t n = 1; n < good.size(); n++) CHECK(!exchange(good.substr(0, n)).got);
+  CHECK(!exchange(std::string(SNMP_BUFFER_SIZE + 1, '\x30')).got);
+  CHECK(snmpStats.parseErrors >= errors + good.size());
+
+  unsigned long seed = 12345, answered = 0;
+  for (int i = 0; i < 2000; i++) {
+    std::string m = good;
+    for (int k = 0; k < 3; k++) {
+      seed = seed * 1103515245 + 12345;
+      m[(seed >> 8) % m.size()] = (char)(seed >> 16);
+    }
+    sim::sendUdp(SNMP_PORT, m);
+    sim::pass(2);
+    sim::Datagram d;
+    while (sim::receiveUdp(40000, d)) answered++;
+  }
+  CHECK_EQ(b.heapUse.allocs, allocs);
+  printf("2000 mutated requests: %lu answered, the rest dropped\n", answered);
+}
+
+int main() {
+  setup();
+  sim::pass(10);
+  sensorPush(231, 455);
+  testWalk();
+  testBulkWalk();
+  testGet();
+  testSet();
+  testCommunities();
+  testMalformed();
+  return testResult("test_snmp");
+}